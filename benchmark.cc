@@ -1,7 +1,12 @@
 
 #include "kdtree.hpp"
+#include "compressed_kdtree.hpp"
 
+#include <chrono>
+#include <iostream>
+#include <memory>
 #include <random>
+#include <vector>
 
 typedef std::tuple<int,char,float> Key;
 typedef ads::detail::mask_type<Key> Mask;
@@ -24,6 +29,98 @@ Mask generateMask() {
 	return Mask( mask_dist(gen) );
 }
 
+// Milliseconds taken by f()
+template < typename F >
+double milliseconds( F f )
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	std::chrono::duration<double,std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+// Batch queries against one find() per query: lookups of inserted keys
+// and of random ones, then small boxes around inserted keys
+template < typename Tree >
+void benchmarkBatch( const Tree& tree, const std::vector<Key>& keys, std::size_t queries )
+{
+	std::uniform_int_distribution<std::size_t> pick(0, keys.size()-1);
+	std::vector<Key> lookups;
+	std::vector<std::pair<Key,Key> > boxes;
+	for( std::size_t i = 0; i < queries; i++ ) {
+		lookups.push_back( i%2? keys[pick(gen)] : generateKey() );
+
+		const Key& k = keys[pick(gen)];
+		const int dx = 1 << 22;
+		const int dy = 16;
+		const float dz = std::numeric_limits<float>::max() / 64;
+		boxes.push_back( std::make_pair(
+			std::make_tuple( std::max<long long>(std::get<0>(k) - 1ll*dx, std::numeric_limits<int>::min()),
+			                 char( std::max(std::get<1>(k) - dy, int(std::numeric_limits<char>::min())) ),
+			                 std::get<2>(k) - dz ),
+			std::make_tuple( std::min<long long>(std::get<0>(k) + 1ll*dx, std::numeric_limits<int>::max()),
+			                 char( std::min(std::get<1>(k) + dy, int(std::numeric_limits<char>::max())) ),
+			                 std::get<2>(k) + dz ) ) );
+	}
+
+	std::size_t found = 0;
+	double single = milliseconds( [&]() {
+		for( const Key& k : lookups )
+			found += tree.find( k ) != nullptr;
+	} );
+	double batch = milliseconds( [&]() {
+		for( const Key* k : tree.find( lookups ) )
+			found += k != nullptr;
+	} );
+	std::cout << "Exact: " << single << " ms single, " << batch << " ms batch" << std::endl;
+
+	single = milliseconds( [&]() {
+		for( const std::pair<Key,Key>& box : boxes )
+			found += tree.find( box.first, box.second ).size();
+	} );
+	batch = milliseconds( [&]() {
+		for( const std::list<const Key*>& list : tree.find( boxes ) )
+			found += list.size();
+	} );
+	std::cout << "Range: " << single << " ms single, " << batch << " ms batch" << std::endl;
+	std::cout << "(" << found << " results)" << std::endl;
+}
+
+// Exact lookups of inserted 8-d double keys, and every 100 lookups a
+// small box around the key. Queries are the same for every tree.
+template < typename Tree >
+void benchmarkPoints( const char* name, const Tree& tree, double build,
+                      const std::vector<std::array<double,8> >& points, std::size_t queries )
+{
+	typedef std::array<double,8> Point;
+	std::default_random_engine query_gen;
+	std::uniform_int_distribution<std::size_t> pick(0, points.size()-1);
+	std::vector<Point> lookups, lower, upper;
+	for( std::size_t i = 0; i < queries; i++ ) {
+		lookups.push_back( points[pick(query_gen)] );
+		if( i % 100 == 0 ) {
+			lower.push_back( lookups.back() );
+			upper.push_back( lookups.back() );
+			for( std::size_t d = 0; d < 8; d++ ) {
+				lower.back()[d] -= 0.2;
+				upper.back()[d] += 0.2;
+			}
+		}
+	}
+
+	std::size_t found = 0;
+	double exact = milliseconds( [&]() {
+		for( const Point& k : lookups )
+			found += tree.find( k ) != nullptr;
+	} );
+	double range = milliseconds( [&]() {
+		for( std::size_t i = 0; i < lower.size(); i++ )
+			found += tree.find( lower[i], upper[i] ).size();
+	} );
+	std::cout << name << ": " << build << " ms build, " << exact << " ms exact, "
+	          << range << " ms range (" << found << " results)" << std::endl;
+}
+
 int main( int argc, char* argv[] )
 {
 #ifdef USE_STANDARD
@@ -47,12 +144,50 @@ int main( int argc, char* argv[] )
 	else
 		searched_elements = inserted_elements;
 		
-	for( int i = 0; i < inserted_elements; i++ ) {
+#ifdef BENCHMARK_COMPRESSED
+	typedef std::array<double,8> Point;
+	std::uniform_real_distribution<double> coordinate( 0.0, 1.0 );
+	std::vector<Point> points( inserted_elements );
+	for( Point& p : points )
+		for( double& x : p )
+			x = coordinate( gen );
+
+	// Compressed trees with 8 and 16 bit codes against standard_kdtree
+	std::unique_ptr<ads::compressed_kdtree<Point,std::uint8_t> > compressed8;
+	double build = milliseconds( [&]() {
+		compressed8.reset( new ads::compressed_kdtree<Point,std::uint8_t>( points.begin(), points.end() ) );
+	} );
+	benchmarkPoints( "Compressed 8 bit", *compressed8, build, points, searched_elements );
+	compressed8.reset();
+
+	std::unique_ptr<ads::compressed_kdtree<Point,std::uint16_t> > compressed16;
+	build = milliseconds( [&]() {
+		compressed16.reset( new ads::compressed_kdtree<Point,std::uint16_t>( points.begin(), points.end() ) );
+	} );
+	benchmarkPoints( "Compressed 16 bit", *compressed16, build, points, searched_elements );
+	compressed16.reset();
+
+	ads::standard_kdtree<Point> standard;
+	build = milliseconds( [&]() {
+		for( const Point& p : points )
+			standard.insert( p );
+	} );
+	benchmarkPoints( "Standard", standard, build, points, searched_elements );
+#elif BENCHMARK_BATCH
+	std::vector<Key> keys;
+	for( std::size_t i = 0; i < inserted_elements; i++ ) {
+		keys.push_back( generateKey() );
+		tree.insert( keys.back() );
+	}
+	benchmarkBatch( tree, keys, searched_elements );
+#else
+	for( std::size_t i = 0; i < inserted_elements; i++ ) {
 		tree.insert( generateKey() );
 	}
-	for( int i = 0; i < searched_elements; i++ ) {
+	for( std::size_t i = 0; i < searched_elements; i++ ) {
 		tree.find( generateKey(), generateMask() );
 	}
+#endif
 
 	return 0;
 }
@@ -0,0 +1,280 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPRESSED_KDTREE
+#define COMPRESSED_KDTREE
+
+#include "detail/kdtree_traits.hpp"
+#include "detail/kdtree_common.hpp"
+#include "detail/quantized_cell.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <list>
+#include <vector>
+
+namespace ads {
+
+// Static kd-tree with quantized keys.
+//
+// Every node stores its coordinates as Code sized offsets (8 or 16 bit)
+// relative to the cell of its subtree, and has no successor pointers:
+// nodes are laid out in preorder, so that the first successor follows
+// its parent and subtree sizes are implied by the balanced build. The
+// cell of a node is derived from its ancestors while descending.
+// Full precision keys are kept in a separate cold array, read only when
+// the quantized coordinates can not decide whether a key matches.
+//
+// Pruning compares coordinates as doubles, so they must be finite and
+// exactly representable as double. Keys are given at construction.
+template < typename T,
+	typename Code = std::uint16_t,
+	typename = traits::require_kdtree_valid_datatype<T>
+	>
+class compressed_kdtree
+{
+	public:
+		typedef T                    Key;
+		typedef detail::mask_type<T> Mask;
+
+		static constexpr std::size_t D = std::tuple_size<T>::value;
+
+		compressed_kdtree() :
+			_codes(),
+			_keys(),
+			_lower(),
+			_upper()
+		{
+		}
+
+		template < typename InputIt >
+		compressed_kdtree( InputIt first, InputIt last ) :
+			compressed_kdtree()
+		{
+			assign( first, last );
+		}
+
+		// Replaces the contents with the distinct keys in [first,last)
+		template < typename InputIt >
+		void assign( InputIt first, InputIt last )
+		{
+			_keys.assign( first, last );
+			std::sort( _keys.begin(), _keys.end() );
+			_keys.erase( std::unique( _keys.begin(), _keys.end() ), _keys.end() );
+			_codes.assign( _keys.size(), Codes() );
+
+			_lower.fill( 0.0 );
+			_upper.fill( 0.0 );
+			Point p;
+			for( std::size_t i = 0; i < _keys.size(); i++ ) {
+				detail::to_point<Key>()( _keys[i], p );
+				for( std::size_t d = 0; d < D; d++ ) {
+					_lower[d] = i == 0? p[d] : std::min( _lower[d], p[d] );
+					_upper[d] = i == 0? p[d] : std::max( _upper[d], p[d] );
+				}
+			}
+
+			Point lo = _lower;
+			Point hi = _upper;
+			build( 0, _keys.size(), 0, lo, hi );
+		}
+
+		bool empty() const
+		{
+			return _keys.empty();
+		}
+
+		std::size_t size() const
+		{
+			return _keys.size();
+		}
+
+		// Exact search
+		const Key* find( const Key& k ) const
+		{
+			Point p;
+			detail::to_point<Key>()( k, p );
+
+			const Key* found = nullptr;
+			search( p, p, [this,&k,&found]( std::size_t i, bool ) {
+				if( _keys[i] == k )
+					found = &_keys[i];
+				return !found;
+			} );
+			return found;
+		}
+
+		// Partial match
+		std::list<const Key*> find( const Key& k, const Mask& mask ) const
+		{
+			Point lower, upper;
+			detail::to_point<Key>()( k, lower );
+			detail::to_point<Key>()( k, upper );
+			for( std::size_t d = 0; d < D; d++ ) {
+				if( !mask[d] ) {
+					lower[d] = -std::numeric_limits<double>::infinity();
+					upper[d] = std::numeric_limits<double>::infinity();
+				}
+			}
+
+			std::list<const Key*> list;
+			search( lower, upper, [this,&k,&mask,&list]( std::size_t i, bool inside ) {
+				if( inside || detail::matches_partially<Key>()( _keys[i], k, mask ) )
+					list.push_back( &_keys[i] );
+				return true;
+			} );
+			return list;
+		}
+
+		// Orthogonal range search
+		// Assumes lower(i) <= upper(i) for all i = [0,D-1]
+		std::list<const Key*> find( const Key& lower, const Key& upper ) const
+		{
+			Point lo, hi;
+			detail::to_point<Key>()( lower, lo );
+			detail::to_point<Key>()( upper, hi );
+
+			std::list<const Key*> list;
+			search( lo, hi, [this,&lower,&upper,&list]( std::size_t i, bool inside ) {
+				if( inside || detail::in_range<Key>()( _keys[i], lower, upper ) )
+					list.push_back( &_keys[i] );
+				return true;
+			} );
+			return list;
+		}
+
+	private:
+		typedef std::array<double,D>      Point;
+		typedef std::array<Code,D>        Codes;
+		typedef detail::cell_quantizer<Code> Quantizer;
+
+		// Subtree of n nodes starting at i. The median on the depth's
+		// discriminant goes first, followed by the n/2 keys below it and
+		// then by the keys above it. Successor cells are cut at the
+		// bounds of the median's slice.
+		void build( std::size_t i, std::size_t n, std::size_t depth, Point& lo, Point& hi )
+		{
+			if( n == 0 )
+				return;
+
+			const std::size_t d = depth % D;
+			Key* first = _keys.data() + i;
+			Key* median = first + n/2;
+			std::nth_element( first, median, first + n,
+				[d]( const Key& lhs, const Key& rhs ) {
+					return detail::less_in_dimension<Key>()( d, lhs, rhs );
+				} );
+			std::rotate( first, median, median+1 );
+
+			Point p;
+			detail::to_point<Key>()( *first, p );
+			for( std::size_t e = 0; e < D; e++ )
+				_codes[i][e] = Quantizer::encode( lo[e], hi[e], p[e] );
+
+			const double split_lo = Quantizer::bound( lo[d], hi[d], _codes[i][d] );
+			const double split_hi = Quantizer::bound( lo[d], hi[d], _codes[i][d] + 1 );
+			const std::size_t below = n/2;
+
+			const double saved_hi = hi[d];
+			hi[d] = split_hi;
+			build( i+1, below, depth+1, lo, hi );
+			hi[d] = saved_hi;
+
+			const double saved_lo = lo[d];
+			lo[d] = split_lo;
+			build( i+1+below, n-1-below, depth+1, lo, hi );
+			lo[d] = saved_lo;
+		}
+
+		// Calls accept(i,inside) for every key i whose quantized
+		// coordinates may lie in [lower,upper]; inside tells if they
+		// are known to. accept returns false to stop the search.
+		template < typename Accept >
+		void search( const Point& lower, const Point& upper, Accept accept ) const
+		{
+			Point lo = _lower;
+			Point hi = _upper;
+			search( 0, _keys.size(), 0, lo, hi, lower, upper, accept );
+		}
+
+		template < typename Accept >
+		bool search( std::size_t i, std::size_t n, std::size_t depth, Point& lo, Point& hi,
+		             const Point& lower, const Point& upper, Accept& accept ) const
+		{
+			if( n == 0 )
+				return true;
+
+			// Every key of a cell inside the query matches
+			bool contained = true;
+			for( std::size_t e = 0; e < D && contained; e++ )
+				contained = lower[e] <= lo[e] && hi[e] <= upper[e];
+			if( contained ) {
+				for( std::size_t j = i; j < i+n; j++ )
+					if( !accept( j, true ) )
+						return false;
+				return true;
+			}
+
+			const Codes& codes = _codes[i];
+			bool outside = false;
+			bool inside = true;
+			for( std::size_t e = 0; e < D && !outside; e++ ) {
+				const double first = Quantizer::bound( lo[e], hi[e], codes[e] );
+				const double last = Quantizer::bound( lo[e], hi[e], codes[e] + 1 );
+				outside = last < lower[e] || upper[e] < first;
+				inside = inside && lower[e] <= first && last <= upper[e];
+			}
+			if( !outside && !accept( i, inside ) )
+				return false;
+
+			const std::size_t d = depth % D;
+			const double split_lo = Quantizer::bound( lo[d], hi[d], codes[d] );
+			const double split_hi = Quantizer::bound( lo[d], hi[d], codes[d] + 1 );
+			const std::size_t below = n/2;
+
+			if( lower[d] <= split_hi ) {
+				const double saved_hi = hi[d];
+				hi[d] = split_hi;
+				const bool go_on = search( i+1, below, depth+1, lo, hi, lower, upper, accept );
+				hi[d] = saved_hi;
+				if( !go_on )
+					return false;
+			}
+			if( split_lo <= upper[d] ) {
+				const double saved_lo = lo[d];
+				lo[d] = split_lo;
+				const bool go_on = search( i+1+below, n-1-below, depth+1, lo, hi, lower, upper, accept );
+				lo[d] = saved_lo;
+				if( !go_on )
+					return false;
+			}
+			return true;
+		}
+
+		std::vector<Codes> _codes; //!< Quantized coordinates, one entry per node
+		std::vector<Key> _keys;    //!< Full precision keys, same order as _codes
+		Point _lower;              //!< Bounding box of every key
+		Point _upper;
+};
+
+} // namespace ads
+
+#endif // COMPRESSED_KDTREE
@@ -0,0 +1,153 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef BATCH_QUERY
+#define BATCH_QUERY
+
+#include "kdtree_common.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <list>
+#include <utility>
+#include <vector>
+
+namespace ads {
+namespace detail {
+
+template < typename T >
+using box_type = std::pair<T,T>;
+
+// Indices of points sorted by Z-order (Morton) curve. Coordinates are
+// scaled to the bounding box of the batch and quantized to 64/D bits
+// (at most 32), which are interleaved into a single code.
+template < std::size_t D >
+std::vector<std::size_t> morton_order_points( const std::vector<std::array<double,D> >& points )
+{
+	constexpr unsigned bits = 64/D < 32? 64/D : 32;
+	const double cells = static_cast<double>( (std::uint64_t(1) << bits) - 1 );
+
+	std::array<double,D> lower, upper;
+	lower.fill( 0.0 );
+	upper.fill( 0.0 );
+	if( !points.empty() ) {
+		lower = points.front();
+		upper = points.front();
+	}
+	for( const std::array<double,D>& p : points ) {
+		for( std::size_t d = 0; d < D; d++ ) {
+			lower[d] = std::min( lower[d], p[d] );
+			upper[d] = std::max( upper[d], p[d] );
+		}
+	}
+
+	std::vector<std::pair<std::uint64_t,std::size_t> > codes;
+	codes.reserve( points.size() );
+	for( std::size_t i = 0; i < points.size(); i++ ) {
+		std::uint64_t code = 0;
+		for( std::size_t d = 0; d < D; d++ ) {
+			const double extent = upper[d] - lower[d];
+			const std::uint64_t cell = extent > 0.0?
+				static_cast<std::uint64_t>( (points[i][d] - lower[d]) / extent * cells ) : 0;
+			for( unsigned b = 0; b < bits; b++ )
+				code |= ((cell >> b) & 1u) << (b*D + d);
+		}
+		codes.push_back( std::make_pair( code, i ) );
+	}
+	std::sort( codes.begin(), codes.end() );
+
+	std::vector<std::size_t> order;
+	order.reserve( codes.size() );
+	for( const std::pair<std::uint64_t,std::size_t>& c : codes )
+		order.push_back( c.second );
+	return order;
+}
+
+template < typename T >
+std::vector<std::size_t> morton_order( const std::vector<T>& keys )
+{
+	std::vector<std::array<double,std::tuple_size<T>::value> > points( keys.size() );
+	for( std::size_t i = 0; i < keys.size(); i++ )
+		to_point<T>()( keys[i], points[i] );
+	return morton_order_points( points );
+}
+
+// Boxes are ordered by their centers
+template < typename T >
+std::vector<std::size_t> morton_order_boxes( const std::vector<box_type<T> >& boxes )
+{
+	constexpr std::size_t D = std::tuple_size<T>::value;
+	std::vector<std::array<double,D> > points( boxes.size() );
+	std::array<double,D> upper;
+	for( std::size_t i = 0; i < boxes.size(); i++ ) {
+		to_point<T>()( boxes[i].first, points[i] );
+		to_point<T>()( boxes[i].second, upper );
+		for( std::size_t d = 0; d < D; d++ )
+			points[i][d] = 0.5*points[i][d] + 0.5*upper[d];
+	}
+	return morton_order_points( points );
+}
+
+// Reorders the indices [first,last) as: those only going left, those
+// going both ways, then the rest, keeping their order within each group.
+// Returns the ends of the first two groups. scratch must have room for
+// last-first indices.
+template < typename GoesLeft, typename GoesRight >
+std::pair<std::size_t*,std::size_t*> partition_batch( std::size_t* first, std::size_t* last,
+                                                      std::size_t* scratch,
+                                                      GoesLeft goes_left, GoesRight goes_right )
+{
+	std::size_t* left = first;
+	std::size_t* both = scratch;
+	std::size_t* right = scratch + (last - first);
+	for( std::size_t* it = first; it != last; ++it ) {
+		if( !goes_left( *it ) )
+			*--right = *it;
+		else if( goes_right( *it ) )
+			*both++ = *it;
+		else
+			*left++ = *it;
+	}
+	std::size_t* middle = std::copy( scratch, both, left );
+	std::reverse_copy( right, scratch + (last - first), middle );
+	return std::make_pair( left, middle );
+}
+
+// Moves the indices in [first,last) that satisfy pred to the end,
+// keeping their order, and returns where they start
+template < typename Pred >
+std::size_t* gather_batch( std::size_t* first, std::size_t* last, std::size_t* scratch, Pred pred )
+{
+	std::size_t* kept = first;
+	std::size_t* moved = scratch;
+	for( std::size_t* it = first; it != last; ++it ) {
+		if( pred( *it ) )
+			*moved++ = *it;
+		else
+			*kept++ = *it;
+	}
+	std::copy( scratch, moved, kept );
+	return kept;
+}
+
+} // namespace detail
+} // namespace ads
+
+#endif // BATCH_QUERY
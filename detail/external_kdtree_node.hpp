@@ -0,0 +1,196 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef EXTERNAL_KDTREE_NODE
+#define EXTERNAL_KDTREE_NODE
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <list>
+#include <type_traits>
+#include <utility>
+
+namespace ads {
+namespace detail {
+
+// kd-tree node that stores a row identifier instead of a key.
+// Coordinates are read with accessor(row, dimension), which is passed
+// down on every call so that it can be inlined.
+template < typename Accessor, std::size_t D, std::size_t discriminant = 0 >
+struct external_kdtree_node
+{
+	// Constants
+	static constexpr std::size_t next_discriminant = (discriminant+1)%D;
+
+	// Constraints
+	static_assert( discriminant < D, "Discriminant value out of range" );
+
+	// Type members
+	typedef std::uint32_t                                            Row;
+	typedef typename std::decay<decltype(
+		std::declval<const Accessor&>()( Row(), std::size_t() ) )>::type Value;
+	typedef std::array<Value,D>                                      Point;
+	typedef std::bitset<D>                                           Mask;
+	typedef external_kdtree_node<Accessor,D,discriminant>            Node;
+	typedef external_kdtree_node<Accessor,D,next_discriminant>       SuccessorNode;
+	typedef std::array<SuccessorNode*,2>                             SuccessorTable;
+
+	// Member functions
+	// Constructors
+	external_kdtree_node( Row row ) :
+		_successors(),
+		_row(row)
+	{
+	}
+
+	~external_kdtree_node()
+	{
+		for( SuccessorNode* successor: _successors ) {
+			if( successor ) {
+				delete successor;
+			}
+		}
+	}
+
+	Row getRow() const { return _row; }
+
+	// Insertion
+	// Rows with equal coordinates are kept, only the same row is rejected
+	bool insert( Row r, const Accessor& at )
+	{
+		bool inserted = false;
+		if( at(_row, discriminant) < at(r, discriminant) ) {
+			if( _successors[0] ) {
+				inserted = _successors[0]->insert(r, at);
+			} else {
+				_successors[0] = SuccessorNode::create_node(r);
+				inserted = true;
+			}
+		} else if( _row != r ) {
+			if( _successors[1] ) {
+				inserted = _successors[1]->insert(r, at);
+			} else {
+				_successors[1] = SuccessorNode::create_node(r);
+				inserted = true;
+			}
+		}
+		return inserted;
+	}
+
+	// Exact search
+	// Returns every row located at p
+	std::list<Row> find( const Point& p, const Accessor& at ) const
+	{
+		std::list<Row> list;
+		if( at(_row, discriminant) < p[discriminant] ) {
+			if( _successors[0] )
+				list = _successors[0]->find(p, at);
+		} else {
+			if( equals( p, at ) )
+				list.push_back( _row );
+			if( _successors[1] )
+				list.splice( list.begin(), _successors[1]->find(p, at) );
+		}
+		return list;
+	}
+
+	// Partial match
+	std::list<Row> find( const Point& p, const Mask& mask, const Accessor& at ) const
+	{
+		std::list<Row> list;
+		const bool ignore_dimension = !mask[discriminant];
+		const bool left = ignore_dimension
+		               || at(_row, discriminant) < p[discriminant];
+		const bool right = ignore_dimension || !left;
+
+		if( matches( p, mask, at ) ) {
+			list.push_back( _row );
+		}
+		if( left && _successors[0] ) {
+			list.splice( list.begin(), _successors[0]->find(p, mask, at) );
+		}
+		if( right && _successors[1] ) {
+			list.splice( list.begin(), _successors[1]->find(p, mask, at) );
+		}
+		return list;
+	}
+
+	// Orthogonal range search
+	// Assumes lower(i) <= upper(i) for all i = [0,D-1]
+	std::list<Row> find( const Point& lower, const Point& upper, const Accessor& at ) const
+	{
+		std::list<Row> list;
+		const Value value = at(_row, discriminant);
+		bool left = value < upper[discriminant];
+		bool right = !( value < lower[discriminant] );
+
+		if( in_range( lower, upper, at ) ) {
+			list.push_back( _row );
+		}
+		if( left && _successors[0] ) {
+			list.splice( list.begin(), _successors[0]->find( lower, upper, at ) );
+		}
+		if( right && _successors[1] ) {
+			list.splice( list.begin(), _successors[1]->find( lower, upper, at ) );
+		}
+		return list;
+	}
+
+	static Node* create_node( Row r )
+	{
+		return new external_kdtree_node( r );
+	}
+
+	// Data members
+	SuccessorTable _successors; //!< Contains a pointer for two successors (binary tree)
+	Row _row; //!< Row of the external data this node refers to
+
+	private:
+		bool equals( const Point& p, const Accessor& at ) const
+		{
+			for( std::size_t d = 0; d < D; d++ )
+				if( !( at(_row, d) == p[d] ) )
+					return false;
+			return true;
+		}
+
+		bool matches( const Point& p, const Mask& mask, const Accessor& at ) const
+		{
+			for( std::size_t d = 0; d < D; d++ )
+				if( mask[d] && !( at(_row, d) == p[d] ) )
+					return false;
+			return true;
+		}
+
+		bool in_range( const Point& lower, const Point& upper, const Accessor& at ) const
+		{
+			for( std::size_t d = 0; d < D; d++ ) {
+				const Value value = at(_row, d);
+				if( value < lower[d] || upper[d] < value )
+					return false;
+			}
+			return true;
+		}
+};
+
+} // namespace detail
+} // namespace ads
+
+#endif // EXTERNAL_KDTREE_NODE
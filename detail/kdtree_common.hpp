@@ -20,7 +20,10 @@
 #ifndef KDTREE_COMMON
 #define KDTREE_COMMON
 
+#include <array>
 #include <bitset>
+#include <memory>
+#include <utility>
 
 namespace ads {
 namespace detail {
@@ -28,6 +31,37 @@ namespace detail {
 template< typename T >
 using mask_type = std::bitset<std::tuple_size<T>::value>;
 
+// Allocates and constructs a node of type Node with an allocator
+// rebound from any other value type
+template < typename Node, typename Allocator, typename... Args >
+Node* allocate_node( Allocator& alloc, Args&&... args )
+{
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Node> NodeAllocator;
+	typedef std::allocator_traits<NodeAllocator>                                  NodeTraits;
+
+	NodeAllocator node_alloc( alloc );
+	Node* node = NodeTraits::allocate( node_alloc, 1 );
+	try {
+		NodeTraits::construct( node_alloc, node, std::forward<Args>(args)... );
+	} catch( ... ) {
+		NodeTraits::deallocate( node_alloc, node, 1 );
+		throw;
+	}
+	return node;
+}
+
+// Destroys and deallocates a node created with allocate_node
+template < typename Node, typename Allocator >
+void deallocate_node( Allocator& alloc, Node* node )
+{
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Node> NodeAllocator;
+	typedef std::allocator_traits<NodeAllocator>                                  NodeTraits;
+
+	NodeAllocator node_alloc( alloc );
+	NodeTraits::destroy( node_alloc, node );
+	NodeTraits::deallocate( node_alloc, node, 1 );
+}
+
 template< typename Integral >
 constexpr Integral power( Integral base, Integral exp )
 {
@@ -54,6 +88,114 @@ struct matches_partially<T,0>
 	}
 };
 
+// Compile-time mask version of matches_partially.
+// Dimensions left out of MaskBits are not compared at all.
+template < typename T, unsigned long long MaskBits, std::size_t I = std::tuple_size<T>::value-1 >
+struct matches_masked
+{
+	bool operator()( const T& lhs, const T& rhs )
+	{
+		return matches_masked<T,MaskBits,I-1>()(lhs, rhs) &&
+		       ( !((MaskBits >> I) & 1ull) ||
+		         std::get<I>(lhs) == std::get<I>(rhs) );
+	}
+};
+
+template < typename T, unsigned long long MaskBits >
+struct matches_masked<T,MaskBits,0>
+{
+	bool operator()( const T& lhs, const T& rhs )
+	{
+		return !(MaskBits & 1ull) || std::get<0>(lhs) == std::get<0>(rhs);
+	}
+};
+
+// Compares a single dimension chosen at run time: lhs(d) < rhs(d)
+template < typename T, std::size_t I = std::tuple_size<T>::value-1 >
+struct less_in_dimension
+{
+	bool operator()( std::size_t d, const T& lhs, const T& rhs )
+	{
+		return d == I? std::get<I>(lhs) < std::get<I>(rhs)
+		             : less_in_dimension<T,I-1>()(d, lhs, rhs);
+	}
+};
+
+template < typename T >
+struct less_in_dimension<T,0>
+{
+	bool operator()( std::size_t, const T& lhs, const T& rhs )
+	{
+		return std::get<0>(lhs) < std::get<0>(rhs);
+	}
+};
+
+// Checks lower(i) <= key(i) <= upper(i) for all i = [0,D-1]
+template < typename T, std::size_t I = std::tuple_size<T>::value-1 >
+struct in_range
+{
+	bool operator()( const T& key, const T& lower, const T& upper )
+	{
+		return in_range<T,I-1>()(key, lower, upper) &&
+		       !( std::get<I>(key) < std::get<I>(lower) ) &&
+		       !( std::get<I>(upper) < std::get<I>(key) );
+	}
+};
+
+template < typename T >
+struct in_range<T,0>
+{
+	bool operator()( const T& key, const T& lower, const T& upper )
+	{
+		return !( std::get<0>(key) < std::get<0>(lower) ) &&
+		       !( std::get<0>(upper) < std::get<0>(key) );
+	}
+};
+
+// Squared euclidean distance between two keys. Every coordinate
+// is converted to double before being subtracted.
+template < typename T, std::size_t I = std::tuple_size<T>::value-1 >
+struct squared_distance
+{
+	double operator()( const T& lhs, const T& rhs )
+	{
+		const double diff = static_cast<double>(std::get<I>(lhs))
+		                  - static_cast<double>(std::get<I>(rhs));
+		return squared_distance<T,I-1>()(lhs, rhs) + diff*diff;
+	}
+};
+
+template < typename T >
+struct squared_distance<T,0>
+{
+	double operator()( const T& lhs, const T& rhs )
+	{
+		const double diff = static_cast<double>(std::get<0>(lhs))
+		                  - static_cast<double>(std::get<0>(rhs));
+		return diff*diff;
+	}
+};
+
+// Converts a key to an array of double coordinates
+template < typename T, std::size_t I = std::tuple_size<T>::value-1 >
+struct to_point
+{
+	void operator()( const T& key, std::array<double,std::tuple_size<T>::value>& point )
+	{
+		to_point<T,I-1>()(key, point);
+		point[I] = static_cast<double>(std::get<I>(key));
+	}
+};
+
+template < typename T >
+struct to_point<T,0>
+{
+	void operator()( const T& key, std::array<double,std::tuple_size<T>::value>& point )
+	{
+		point[0] = static_cast<double>(std::get<0>(key));
+	}
+};
+
 } // namespace detail
 } // namespace ads
 
@@ -20,18 +20,23 @@
 #ifndef KDTREE_NODE
 #define KDTREE_NODE
 
+#include "batch_query.hpp"
 #include "kdtree_common.hpp"
 #include "kdtree_traits.hpp"
+#include "knearest_search.hpp"
+#include "lazy_search.hpp"
 
+#include <algorithm>
 #include <array>
 #include <list>
 #include <tuple>
 #include <type_traits>
+#include <vector>
 
 namespace ads {
 namespace detail {
 
-template < typename T, std::size_t discriminant = 0 >
+template < typename T, std::size_t discriminant = 0, typename Allocator = std::allocator<T> >
 struct kdtree_node
 {
 	// Constants
@@ -44,52 +49,60 @@ struct kdtree_node
 	static_assert( 0 <= discriminant, "Discriminant value out of range" );
 
 	// Type members
-	typedef T                                Key;
-	typedef kdtree_node<T,discriminant>      Node;
-	typedef kdtree_node<T,next_discriminant> SuccessorNode;
-	typedef std::array<SuccessorNode*,2>     SuccessorTable;
+	typedef T                                          Key;
+	typedef Allocator                                  allocator_type;
+	typedef kdtree_node<T,discriminant,Allocator>      Node;
+	typedef kdtree_node<T,next_discriminant,Allocator> SuccessorNode;
+	typedef std::array<SuccessorNode*,2>               SuccessorTable;
 
 	// Member functions
 	// Constructors
-	kdtree_node( const Key& key ) :
+	template < typename K >
+	explicit kdtree_node( K&& key ) :
 		_successors(),
-		_key(key)
+		_key(std::forward<K>(key))
 	{
 	}
 
-	~kdtree_node()
-	{
-		for( SuccessorNode* successor: _successors ) {
-			if( successor ) {
-				delete successor;
-			}
-		}
-	}
-
 	const Key& getKey() const { return _key; }
 
+	std::size_t getDiscriminant() const { return discriminant; }
+
 	// Insertion
-	bool insert( const Key& k2 )
+	// k2 is only copied or moved into the new node
+	template < typename K >
+	bool insert( K&& k2, Allocator& alloc )
 	{
 		bool inserted = false;
 		if( std::get<discriminant>(_key) < std::get<discriminant>(k2) ) {
 			if( _successors[0] ) {
-				inserted = _successors[0]->insert(k2);
+				inserted = _successors[0]->insert(std::forward<K>(k2), alloc);
 			} else {
-				_successors[0] = SuccessorNode::create_node(k2);
+				_successors[0] = SuccessorNode::create_node(std::forward<K>(k2), alloc);
 				inserted = true;
 			}
 		} else if( _key != k2 ) {
 			if( _successors[1] ) {
-				inserted = _successors[1]->insert(k2);
+				inserted = _successors[1]->insert(std::forward<K>(k2), alloc);
 			} else {
-				_successors[1] = SuccessorNode::create_node(k2);
+				_successors[1] = SuccessorNode::create_node(std::forward<K>(k2), alloc);
 				inserted = true;
 			}
 		}
 		return inserted;
 	}
 
+	// Moves every key of the subtree into keys
+	void extract( std::vector<Key>& keys )
+	{
+		keys.push_back( std::move(_key) );
+		for( SuccessorNode* successor: _successors ) {
+			if( successor ) {
+				successor->extract( keys );
+			}
+		}
+	}
+
 	// Exact search
 	const Key* find( const Key& k2 ) const
 	{
@@ -112,7 +125,7 @@ struct kdtree_node
 	std::list<const Key*> find( const Key& k2, const mask_type<T>& mask ) const
 	{
 		std::list<const Key*> list;
-		const bool ignore_dimension = mask[discriminant];
+		const bool ignore_dimension = !mask[discriminant];
 		const bool left = ignore_dimension
 		               || std::get<discriminant>(_key) < std::get<discriminant>(k2);
 		const bool right = ignore_dimension || !left;
@@ -123,35 +136,197 @@ struct kdtree_node
 		if( left && _successors[0] ) {
 			list.splice( list.begin(), _successors[0]->find(k2, mask) );
 		}
-		if( left && _successors[1] ) {
+		if( right && _successors[1] ) {
 			list.splice( list.begin(), _successors[1]->find(k2, mask) );
 		}
 		return list;
 	}
 
+	// Partial match with a compile-time mask
+	// Whether this level's dimension is specified is known when the
+	// template is instantiated, so the child selection folds away.
+	template< unsigned long long MaskBits >
+	std::list<const Key*> find( const Key& k2 ) const
+	{
+		std::list<const Key*> list;
+		constexpr bool ignore_dimension = !((MaskBits >> discriminant) & 1ull);
+		const bool left = ignore_dimension
+		               || std::get<discriminant>(_key) < std::get<discriminant>(k2);
+		const bool right = ignore_dimension || !left;
+
+		if( matches_masked<Key,MaskBits>()( _key, k2 ) ) {
+			list.push_back( &_key );
+		}
+		if( left && _successors[0] ) {
+			list.splice( list.begin(), _successors[0]->template find<MaskBits>(k2) );
+		}
+		if( right && _successors[1] ) {
+			list.splice( list.begin(), _successors[1]->template find<MaskBits>(k2) );
+		}
+		return list;
+	}
+
 	// Orthogonal range search
 	// Assumes lower(i) <= upper(i) for all i = [0,D-1]
 	std::list<const Key*> find( const Key& lower, const Key& upper ) const
 	{
 		std::list<const Key*> list;
-		bool left = std::get<discriminant>(lower) <= std::get<discriminant>(_key);
-		bool right = std::get<discriminant>(_key) <= std::get<discriminant>(upper);
+		bool left = std::get<discriminant>(_key) < std::get<discriminant>(upper);
+		bool right = std::get<discriminant>(lower) <= std::get<discriminant>(_key);
 
-		if( left || right ) {
+		if( in_range<Key>()( _key, lower, upper ) ) {
 			list.push_back( &_key );
 		}
 		if( left && _successors[0] ) {
 			list.splice( list.begin(), _successors[0]->find( lower, upper ) );
 		}
 		if( right && _successors[1] ) {
-			list.splice( list.begin(), _successors[0]->find( lower, upper ) );
+			list.splice( list.begin(), _successors[1]->find( lower, upper ) );
 		}
+		return list;
 	}
 
+	// Batch exact search
+	// Queries in [first,last) (indices into keys) that reach this node are
+	// either answered here or moved, in order, to the part of the range
+	// forwarded to each successor. Each node is read once per batch.
+	// scratch must have room for last-first indices.
+	void find( const std::vector<Key>& keys, std::size_t* first, std::size_t* last,
+	           std::size_t* scratch, std::vector<const Key*>& found ) const
+	{
+		std::size_t* left = first;
+		std::size_t* right = scratch;
+		for( std::size_t* it = first; it != last; ++it ) {
+			const Key& k2 = keys[*it];
+			if( std::get<discriminant>(_key) < std::get<discriminant>(k2) )
+				*left++ = *it;
+			else if( _key == k2 )
+				found[*it] = &_key;
+			else
+				*right++ = *it;
+		}
+		std::size_t* middle = left;
+		std::size_t* end = std::copy( scratch, right, middle );
+		if( first != middle && _successors[0] )
+			_successors[0]->find( keys, first, middle, scratch, found );
+		if( middle != end && _successors[1] )
+			_successors[1]->find( keys, middle, end, scratch, found );
+	}
+
+	// Batch orthogonal range search
+	// Boxes in [first,last) (indices into boxes) that reach this node
+	// are reordered in place so that the ones going to each successor
+	// form a range; the ones going to both sides are gathered again
+	// after the first successor returns.
+	void find( const std::vector<box_type<Key> >& boxes, std::size_t* first, std::size_t* last,
+	           std::size_t* scratch, std::vector<std::list<const Key*> >& found ) const
+	{
+		auto goes_left = [&]( std::size_t i ) {
+			return std::get<discriminant>(_key) < std::get<discriminant>(boxes[i].second);
+		};
+		auto goes_right = [&]( std::size_t i ) {
+			return std::get<discriminant>(boxes[i].first) <= std::get<discriminant>(_key);
+		};
+
+		for( std::size_t* it = first; it != last; ++it )
+			if( in_range<Key>()( _key, boxes[*it].first, boxes[*it].second ) )
+				found[*it].push_back( &_key );
+
+		std::pair<std::size_t*,std::size_t*> parts = partition_batch( first, last, scratch, goes_left, goes_right );
+		std::size_t* right = parts.first;
+		if( first != parts.second && _successors[0] ) {
+			_successors[0]->find( boxes, first, parts.second, scratch, found );
+			right = gather_batch( first, parts.second, scratch, goes_right );
+		}
+		if( right != last && _successors[1] )
+			_successors[1]->find( boxes, right, last, scratch, found );
+	}
 
-	static Node* create_node( const Key& k )
+	// Lazy orthogonal range search step
+	const Key* step( range_cursor<Key>& cursor ) const
 	{
-		return new kdtree_node( k );
+		const range_query<Key>& q = cursor.query();
+		if( std::get<discriminant>(_key) < std::get<discriminant>(q.upper) )
+			cursor.push( _successors[0] );
+		if( std::get<discriminant>(q.lower) <= std::get<discriminant>(_key) )
+			cursor.push( _successors[1] );
+		return in_range<Key>()( _key, q.lower, q.upper )? &_key : nullptr;
+	}
+
+	// Lazy partial match step
+	const Key* step( partial_cursor<Key>& cursor ) const
+	{
+		const partial_query<Key>& q = cursor.query();
+		const bool ignore_dimension = !q.mask[discriminant];
+		const bool left = ignore_dimension
+		               || std::get<discriminant>(_key) < std::get<discriminant>(q.key);
+		const bool right = ignore_dimension || !left;
+
+		if( left )
+			cursor.push( _successors[0] );
+		if( right )
+			cursor.push( _successors[1] );
+		return matches_partially<Key>()( _key, q.key, q.mask )? &_key : nullptr;
+	}
+
+	// Nearest neighbour search step
+	// Near successor keeps our bound, the far one is at least as
+	// far as the splitting hyperplane.
+	void find_nearest( knearest_search<Key>& search, double bound ) const
+	{
+		const Key& q = search.query();
+		const double diff = static_cast<double>(std::get<discriminant>(q))
+		                  - static_cast<double>(std::get<discriminant>(_key));
+		const std::size_t near = std::get<discriminant>(_key) < std::get<discriminant>(q)? 0 : 1;
+
+		search.consider( _key );
+		search.push( _successors[near], bound );
+		search.push( _successors[1-near], std::max(bound, diff*diff) );
+	}
+
+	template < typename K >
+	static Node* create_node( K&& k, Allocator& alloc )
+	{
+		return allocate_node<Node>( alloc, std::forward<K>(k) );
+	}
+
+	// Destroys a whole subtree
+	static void destroy_node( Node* node, Allocator& alloc )
+	{
+		if( node ) {
+			for( SuccessorNode* successor: node->_successors ) {
+				SuccessorNode::destroy_node( successor, alloc );
+			}
+			deallocate_node( alloc, node );
+		}
+	}
+
+	// Builds a balanced subtree from the distinct keys [first,last),
+	// which are moved into the nodes. The median on this level's
+	// discriminant becomes the root.
+	static Node* build( Key* first, Key* last, Allocator& alloc )
+	{
+		if( first == last )
+			return nullptr;
+
+		auto less = []( const Key& lhs, const Key& rhs ) {
+			return std::get<discriminant>(lhs) < std::get<discriminant>(rhs);
+		};
+		Key* pivot = last-1;
+		std::nth_element( first, first + (last-first)/2, last, less );
+		std::iter_swap( first + (last-first)/2, pivot );
+		Key* split = std::partition( first, pivot,
+			[&]( const Key& k ) { return less( *pivot, k ); } );
+
+		Node* node = create_node( std::move(*pivot), alloc );
+		try {
+			node->_successors[0] = SuccessorNode::build( first, split, alloc );
+			node->_successors[1] = SuccessorNode::build( split, pivot, alloc );
+		} catch( ... ) {
+			destroy_node( node, alloc );
+			throw;
+		}
+		return node;
 	}
 
 	// Data members
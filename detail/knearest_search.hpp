@@ -0,0 +1,169 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef KNEAREST_SEARCH
+#define KNEAREST_SEARCH
+
+#include "kdtree_common.hpp"
+
+#include <cstddef>
+#include <list>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace ads {
+namespace detail {
+
+template < typename T >
+struct knearest_result
+{
+	typedef T Key;
+
+	std::list<const Key*> keys; //!< Closest keys found, nearest first
+	bool exact;                 //!< True if keys are the exact k nearest
+	std::size_t visited_nodes;  //!< Number of nodes expanded
+};
+
+// Best-bin-first k nearest neighbour search state.
+// Nodes are kept in a priority queue ordered by a lower bound of the
+// squared distance between the query and any key in their subtree.
+// Each node type provides find_nearest( search, bound ), which checks
+// its own key and pushes its successors with their lower bounds.
+template < typename T >
+class knearest_search
+{
+	public:
+		typedef T Key;
+		typedef void (*visit_function)( const void*, double, knearest_search& );
+
+		knearest_search( const Key& query, std::size_t k, double epsilon, std::size_t max_nodes ) :
+			_query(query),
+			_k(k),
+			_scale( (1.0+epsilon)*(1.0+epsilon) ),
+			_max_nodes(max_nodes),
+			_pruned(false),
+			_visited(0),
+			_pending(),
+			_best()
+		{
+		}
+
+		const Key& query() const { return _query; }
+
+		// Offers a key as a result candidate
+		void consider( const Key& key )
+		{
+			const double distance = squared_distance<Key>()( key, _query );
+			if( _best.size() < _k ) {
+				_best.push( std::make_pair(distance, &key) );
+			} else if( distance < _best.top().first ) {
+				_best.pop();
+				_best.push( std::make_pair(distance, &key) );
+			}
+		}
+
+		// Enqueues a subtree whose keys are at least sqrt(bound) away
+		template < typename Node >
+		void push( const Node* node, double bound )
+		{
+			if( node && !prune(bound) )
+				_pending.push( entry{ bound, node, &visit<Node> } );
+		}
+
+		template < typename Node >
+		knearest_result<Key> run( const Node* root )
+		{
+			push( root, 0.0 );
+			while( !_pending.empty() && _visited < _max_nodes ) {
+				entry next = _pending.top();
+				_pending.pop();
+				if( !prune(next.bound) ) {
+					_visited++;
+					next.visit( next.node, next.bound, *this );
+				}
+			}
+
+			knearest_result<Key> result;
+			result.exact = !_pruned &&
+			               ( _pending.empty() || !improves(_pending.top().bound) );
+			result.visited_nodes = _visited;
+			while( !_best.empty() ) {
+				result.keys.push_front( _best.top().second );
+				_best.pop();
+			}
+			return result;
+		}
+
+	private:
+		struct entry
+		{
+			double bound;
+			const void* node;
+			visit_function visit;
+
+			// Reversed so that std::priority_queue pops the lowest bound
+			bool operator<( const entry& other ) const
+			{
+				return other.bound < bound;
+			}
+		};
+
+		typedef std::pair<double,const Key*> candidate;
+
+		template < typename Node >
+		static void visit( const void* node, double bound, knearest_search& search )
+		{
+			static_cast<const Node*>(node)->find_nearest( search, bound );
+		}
+
+		// True if a subtree with this bound may contain a closer key
+		bool improves( double bound ) const
+		{
+			return _best.size() < _k || bound < _best.top().first;
+		}
+
+		// (1+epsilon) pruning: discards subtrees that can not improve
+		// the current k-th distance by more than that factor.
+		// Records whether an exact search would have kept it.
+		bool prune( double bound )
+		{
+			if( _k == 0 )
+				return true;
+			if( _best.size() < _k || bound*_scale < _best.top().first )
+				return false;
+			if( improves(bound) )
+				_pruned = true;
+			return true;
+		}
+
+		Key _query;
+		std::size_t _k;
+		double _scale;
+		std::size_t _max_nodes;
+		bool _pruned;
+		std::size_t _visited;
+		std::priority_queue<entry> _pending;
+		std::priority_queue<candidate> _best; //!< Max-heap on distance
+};
+
+} // namespace detail
+} // namespace ads
+
+#endif // KNEAREST_SEARCH
@@ -0,0 +1,218 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZY_SEARCH
+#define LAZY_SEARCH
+
+#include "kdtree_common.hpp"
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+namespace ads {
+namespace detail {
+
+template < typename T >
+struct range_query
+{
+	T lower;
+	T upper;
+};
+
+template < typename T >
+struct partial_query
+{
+	T key;
+	mask_type<T> mask;
+};
+
+// Depth-first traversal state for queries that are evaluated on demand.
+// Holds the subtrees still to be visited; each node type provides
+// step( cursor ), which pushes the successors that may contain matches
+// and returns its own key if it matches (nullptr otherwise).
+template < typename T, typename Query >
+class lazy_cursor
+{
+	public:
+		typedef T     Key;
+		typedef Query query_type;
+
+		lazy_cursor() :
+			_query(),
+			_pending(),
+			_current(nullptr)
+		{
+		}
+
+		template < typename Node >
+		lazy_cursor( const Node* root, const Query& query ) :
+			_query(query),
+			_pending(),
+			_current(nullptr)
+		{
+			push( root );
+			advance();
+		}
+
+		const Query& query() const { return _query; }
+
+		const Key* const& current() const { return _current; }
+
+		template < typename Node >
+		void push( const Node* node )
+		{
+			if( node )
+				_pending.push_back( frame{ node, &visit<Node> } );
+		}
+
+		// Moves to the next match, or to the end if there are none left
+		void advance()
+		{
+			_current = nullptr;
+			while( !_current && !_pending.empty() ) {
+				frame next = _pending.back();
+				_pending.pop_back();
+				_current = next.visit( next.node, *this );
+			}
+		}
+
+	private:
+		typedef const Key* (*visit_function)( const void*, lazy_cursor& );
+
+		struct frame
+		{
+			const void* node;
+			visit_function visit;
+		};
+
+		template < typename Node >
+		static const Key* visit( const void* node, lazy_cursor& cursor )
+		{
+			return static_cast<const Node*>(node)->step( cursor );
+		}
+
+		Query _query;
+		std::vector<frame> _pending;
+		const Key* _current;
+};
+
+template < typename T >
+using range_cursor = lazy_cursor<T, range_query<T> >;
+
+template < typename T >
+using partial_cursor = lazy_cursor<T, partial_query<T> >;
+
+// Forward iterator over the matches of a lazy_cursor.
+// Copies are independent traversals.
+template < typename Cursor >
+class lazy_iterator
+{
+	public:
+		typedef typename Cursor::Key      Key;
+		typedef std::forward_iterator_tag iterator_category;
+		typedef const Key*                value_type;
+		typedef std::ptrdiff_t            difference_type;
+		typedef const value_type*         pointer;
+		typedef const value_type&         reference;
+
+		// End iterator
+		lazy_iterator() :
+			_cursor()
+		{
+		}
+
+		explicit lazy_iterator( const Cursor& cursor ) :
+			_cursor(cursor)
+		{
+		}
+
+		reference operator*() const { return _cursor.current(); }
+
+		pointer operator->() const { return &_cursor.current(); }
+
+		lazy_iterator& operator++()
+		{
+			_cursor.advance();
+			return *this;
+		}
+
+		lazy_iterator operator++( int )
+		{
+			lazy_iterator old( *this );
+			_cursor.advance();
+			return old;
+		}
+
+		bool operator==( const lazy_iterator& other ) const
+		{
+			return _cursor.current() == other._cursor.current();
+		}
+
+		bool operator!=( const lazy_iterator& other ) const
+		{
+			return !( *this == other );
+		}
+
+	private:
+		Cursor _cursor;
+};
+
+// Query result whose matches are found while it is being iterated.
+// Nothing is buffered: begin() walks the tree up to the first match.
+template < typename Node, typename Cursor >
+class lazy_view
+{
+	public:
+		typedef typename Cursor::Key        Key;
+		typedef typename Cursor::query_type Query;
+		typedef lazy_iterator<Cursor>       iterator;
+		typedef iterator                    const_iterator;
+
+		lazy_view( const Node* root, const Query& query ) :
+			_root(root),
+			_query(query)
+		{
+		}
+
+		iterator begin() const
+		{
+			return iterator( Cursor( _root, _query ) );
+		}
+
+		iterator end() const
+		{
+			return iterator();
+		}
+
+		// True if there is at least one match
+		bool exists() const
+		{
+			return Cursor( _root, _query ).current() != nullptr;
+		}
+
+	private:
+		const Node* _root;
+		Query _query;
+};
+
+} // namespace detail
+} // namespace ads
+
+#endif // LAZY_SEARCH
@@ -0,0 +1,309 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PAGE_FILE
+#define PAGE_FILE
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace ads {
+namespace detail {
+
+typedef std::uint64_t page_id;
+
+static constexpr page_id no_page = ~page_id(0);
+
+// File split in fixed size pages, accessed with positional I/O
+class page_file
+{
+	public:
+		page_file( const std::string& path, std::size_t page_size ) :
+			_fd( ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 ) ),
+			_page_size(page_size)
+		{
+			if( _fd < 0 )
+				throw std::system_error( errno, std::generic_category(), "open " + path );
+		}
+
+		page_file( const page_file& ) = delete;
+		page_file& operator=( const page_file& ) = delete;
+
+		~page_file()
+		{
+			::close( _fd );
+		}
+
+		std::size_t page_size() const { return _page_size; }
+
+		void read( page_id page, char* buffer ) const
+		{
+			transfer( page, buffer, false );
+		}
+
+		void write( page_id page, const char* buffer )
+		{
+			transfer( page, const_cast<char*>(buffer), true );
+		}
+
+		// Hints the kernel to start reading a page in the background
+		void prefetch( page_id page ) const
+		{
+#ifdef POSIX_FADV_WILLNEED
+			::posix_fadvise( _fd, offset(page), _page_size, POSIX_FADV_WILLNEED );
+#endif
+		}
+
+	private:
+		off_t offset( page_id page ) const
+		{
+			return static_cast<off_t>( page * _page_size );
+		}
+
+		void transfer( page_id page, char* buffer, bool write ) const
+		{
+			std::size_t done = 0;
+			while( done < _page_size ) {
+				ssize_t n = write?
+					::pwrite( _fd, buffer + done, _page_size - done, offset(page) + done ) :
+					::pread( _fd, buffer + done, _page_size - done, offset(page) + done );
+				if( n < 0 && errno == EINTR )
+					continue;
+				if( n < 0 )
+					throw std::system_error( errno, std::generic_category(), write? "pwrite" : "pread" );
+				if( n == 0 )
+					throw std::runtime_error( "Unexpected end of page file" );
+				done += n;
+			}
+		}
+
+		int _fd;
+		std::size_t _page_size;
+};
+
+// Fixed number of in-memory page frames with CLOCK replacement.
+// Pages are read only through the pool: they are written once, directly
+// to the file, and discard() must be called before a page is rewritten.
+// Pool bookkeeping is protected by a mutex, so pages can be pinned and
+// read from several threads at once. The contents of a pinned frame
+// never change, so they are read without holding the lock. A miss
+// reserves its frame and marks it as loading before reading the page
+// without the lock; threads pinning the same page wait for that read,
+// threads pinning other pages do not.
+class buffer_pool
+{
+	public:
+		buffer_pool( page_file& file, std::size_t frames ) :
+			_file(file),
+			_data( file.page_size() * frames ),
+			_frames( frames ),
+			_table(),
+			_hand(0),
+			_hits(0),
+			_misses(0),
+			_mutex(),
+			_loaded()
+		{
+			if( frames == 0 )
+				throw std::invalid_argument( "Buffer pool needs at least one frame" );
+		}
+
+		// Returns the page contents and keeps them resident until unpin()
+		const char* pin( page_id page )
+		{
+			std::unique_lock<std::mutex> lock( _mutex );
+			auto it = _table.find( page );
+			while( it != _table.end() && _frames[it->second].loading ) {
+				_loaded.wait( lock );
+				it = _table.find( page );
+			}
+			if( it != _table.end() ) {
+				_hits++;
+				frame& f = _frames[it->second];
+				f.pins++;
+				f.referenced = true;
+				return frame_data(it->second);
+			}
+
+			// Miss: the frame stays pinned while it is being loaded, so
+			// it can not be chosen as a victim nor discarded
+			_misses++;
+			const std::size_t index = victim();
+			frame& f = _frames[index];
+			f.page = page;
+			f.pins = 1;
+			f.referenced = true;
+			f.loading = true;
+			_table[page] = index;
+			lock.unlock();
+
+			try {
+				_file.read( page, frame_data(index) );
+			} catch( ... ) {
+				lock.lock();
+				_table.erase( page );
+				f = frame();
+				_loaded.notify_all();
+				throw;
+			}
+
+			lock.lock();
+			f.loading = false;
+			_loaded.notify_all();
+			return frame_data(index);
+		}
+
+		void unpin( page_id page )
+		{
+			std::lock_guard<std::mutex> guard( _mutex );
+			_frames[_table.at(page)].pins--;
+		}
+
+		// Read-ahead for a page that is about to be pinned
+		void prefetch( page_id page )
+		{
+			std::lock_guard<std::mutex> guard( _mutex );
+			if( _table.find( page ) == _table.end() )
+				_file.prefetch( page );
+		}
+
+		// Drops cached copies of pages [first, first+count)
+		void discard( page_id first, std::size_t count )
+		{
+			std::lock_guard<std::mutex> guard( _mutex );
+			for( frame& f : _frames ) {
+				if( f.page != no_page && first <= f.page && f.page < first + count ) {
+					if( f.pins > 0 )
+						throw std::logic_error( "Discarding a pinned page" );
+					_table.erase( f.page );
+					f = frame();
+				}
+			}
+		}
+
+		std::size_t hits() const
+		{
+			std::lock_guard<std::mutex> guard( _mutex );
+			return _hits;
+		}
+
+		std::size_t misses() const
+		{
+			std::lock_guard<std::mutex> guard( _mutex );
+			return _misses;
+		}
+
+	private:
+		struct frame
+		{
+			frame() : page(no_page), pins(0), referenced(false), loading(false) {}
+
+			page_id page;
+			unsigned pins;
+			bool referenced;
+			bool loading;
+		};
+
+		char* frame_data( std::size_t index )
+		{
+			return _data.data() + index * _file.page_size();
+		}
+
+		// CLOCK: skips pinned frames and gives a second chance to
+		// recently referenced ones
+		std::size_t victim()
+		{
+			for( std::size_t step = 0; step < 2*_frames.size(); step++ ) {
+				std::size_t index = _hand;
+				frame& f = _frames[index];
+				_hand = (_hand + 1) % _frames.size();
+
+				if( f.page == no_page )
+					return index;
+				if( f.pins > 0 )
+					continue;
+				if( f.referenced ) {
+					f.referenced = false;
+					continue;
+				}
+				_table.erase( f.page );
+				f = frame();
+				return index;
+			}
+			throw std::runtime_error( "All buffer pool frames are pinned" );
+		}
+
+		page_file& _file;
+		std::vector<char> _data;
+		std::vector<frame> _frames;
+		std::unordered_map<page_id,std::size_t> _table;
+		std::size_t _hand;
+		std::size_t _hits;
+		std::size_t _misses;
+		mutable std::mutex _mutex;
+		std::condition_variable _loaded;
+};
+
+// Keeps a page pinned for its lifetime
+class pinned_page
+{
+	public:
+		pinned_page( buffer_pool& pool, page_id page ) :
+			_pool(pool),
+			_page(page),
+			_data( pool.pin(page) )
+		{
+		}
+
+		pinned_page( const pinned_page& ) = delete;
+		pinned_page& operator=( const pinned_page& ) = delete;
+
+		~pinned_page()
+		{
+			_pool.unpin( _page );
+		}
+
+		template < typename Page >
+		const Page& as() const
+		{
+			return *reinterpret_cast<const Page*>( _data );
+		}
+
+	private:
+		buffer_pool& _pool;
+		page_id _page;
+		const char* _data;
+};
+
+} // namespace detail
+} // namespace ads
+
+#endif // PAGE_FILE
@@ -0,0 +1,338 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PAGED_KDTREE_NODE
+#define PAGED_KDTREE_NODE
+
+#include "kdtree_common.hpp"
+#include "page_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace ads {
+namespace detail {
+
+// Largest F = 2^h such that F-1 splits and F children fit in a page
+constexpr std::size_t page_fanout( std::size_t space, std::size_t split_size, std::size_t fanout = 2 )
+{
+	return (2*fanout-1)*split_size + 2*fanout*sizeof(page_id) > space?
+		fanout : page_fanout( space, split_size, 2*fanout );
+}
+
+constexpr std::size_t floor_log2( std::size_t n )
+{
+	return n <= 1? 0 : 1 + floor_log2( n/2 );
+}
+
+// Key serialized one dimension after another, so that keys that are not
+// trivially copyable as a whole (e.g. std::tuple) can be stored in pages
+// as raw bytes. Every coordinate type must be trivially copyable.
+template < typename T, std::size_t I = std::tuple_size<T>::value-1 >
+struct key_serializer
+{
+	typedef typename std::tuple_element<I,T>::type Value;
+	typedef key_serializer<T,I-1>                  Previous;
+
+	static_assert( std::is_trivially_copyable<Value>::value,
+	               "Coordinates are stored in pages as raw bytes" );
+
+	static constexpr std::size_t offset = Previous::size;
+	static constexpr std::size_t size = offset + sizeof(Value);
+
+	static void store( const T& key, unsigned char* bytes )
+	{
+		Previous::store( key, bytes );
+		std::memcpy( bytes + offset, &std::get<I>(key), sizeof(Value) );
+	}
+
+	static void load( const unsigned char* bytes, T& key )
+	{
+		Previous::load( bytes, key );
+		std::memcpy( &std::get<I>(key), bytes + offset, sizeof(Value) );
+	}
+};
+
+template < typename T >
+struct key_serializer<T,0>
+{
+	typedef typename std::tuple_element<0,T>::type Value;
+
+	static_assert( std::is_trivially_copyable<Value>::value,
+	               "Coordinates are stored in pages as raw bytes" );
+
+	static constexpr std::size_t size = sizeof(Value);
+
+	static void store( const T& key, unsigned char* bytes )
+	{
+		std::memcpy( bytes, &std::get<0>(key), sizeof(Value) );
+	}
+
+	static void load( const unsigned char* bytes, T& key )
+	{
+		std::memcpy( &std::get<0>(key), bytes, sizeof(Value) );
+	}
+};
+
+template < typename T >
+struct key_record
+{
+	typedef key_serializer<T> Serializer;
+
+	key_record() = default;
+
+	explicit key_record( const T& key )
+	{
+		Serializer::store( key, bytes );
+	}
+
+	T load() const
+	{
+		T key;
+		Serializer::load( bytes, key );
+		return key;
+	}
+
+	unsigned char bytes[Serializer::size];
+};
+
+// Order used to split pages: dimension d first, then the whole key.
+// Distinct keys are always on one side of a split, even when they
+// share the coordinate on d.
+template < typename T >
+bool split_less( std::size_t d, const T& lhs, const T& rhs )
+{
+	if( less_in_dimension<T>()( d, lhs, rhs ) )
+		return true;
+	if( less_in_dimension<T>()( d, rhs, lhs ) )
+		return false;
+	return lhs < rhs;
+}
+
+// On-disk layout of a static kd-tree (kd-B-tree / Bkd-tree style).
+// Leaf pages hold keys. Internal pages hold a complete binary kd-tree of
+// F-1 splits, stored in heap order, whose F leaves point to child pages.
+// Left children hold keys with key(d) <= split(d), right children keys
+// with key(d) >= split(d).
+template < typename T, std::size_t PageSize >
+struct paged_kdtree_layout
+{
+	typedef T             Key;
+	typedef key_record<T> record;
+
+	static constexpr std::size_t D = std::tuple_size<T>::value;
+
+	struct header
+	{
+		std::uint32_t leaf;
+		std::uint32_t count;
+	};
+
+	struct split
+	{
+		record key;
+		std::uint32_t discriminant;
+	};
+
+	static constexpr std::size_t leaf_capacity = (PageSize - sizeof(header)) / sizeof(record);
+	static constexpr std::size_t fanout = page_fanout( PageSize - sizeof(header), sizeof(split) );
+	static constexpr std::size_t splits = fanout - 1;
+	static constexpr std::size_t height = floor_log2( fanout );
+
+	struct leaf_page
+	{
+		header head;
+		std::array<record,leaf_capacity> keys;
+	};
+
+	struct internal_page
+	{
+		header head;
+		std::array<split,splits> nodes;
+		std::array<page_id,fanout> children;
+	};
+
+	static_assert( leaf_capacity >= fanout, "Page size too small for this key type" );
+	static_assert( fanout <= 256, "Page size too large for this key type" );
+	static_assert( sizeof(leaf_page) <= PageSize, "Leaf page layout exceeds page size" );
+	static_assert( sizeof(internal_page) <= PageSize, "Internal page layout exceeds page size" );
+	static_assert( std::is_trivially_copyable<leaf_page>::value &&
+	               std::is_trivially_copyable<internal_page>::value,
+	               "Pages are copied as raw bytes" );
+
+	static const header& head( const char* data )
+	{
+		return *reinterpret_cast<const header*>( data );
+	}
+
+	// Number of pages written by build() for n keys
+	static std::size_t pages( std::size_t n )
+	{
+		if( n == 0 )
+			return 0;
+		if( n <= leaf_capacity )
+			return 1;
+		return 1 + subtree_pages( n, height );
+	}
+
+	// Writes a tree with keys [first,last) into consecutive pages,
+	// children before parents, starting at page first_page.
+	// Returns the root page.
+	static page_id build( page_file& file, page_id first_page, Key* first, Key* last,
+	                      std::size_t depth = 0 )
+	{
+		std::vector<char> buffer( PageSize );
+		page_id next = first_page;
+		if( first == last )
+			return no_page;
+		return build( file, buffer, next, first, last, depth );
+	}
+
+	// Fills the splits of an internal page from the median splits of
+	// [first,last), a sample of the keys that go below it
+	static void choose_splits( internal_page& page, Key* first, Key* last, std::size_t depth )
+	{
+		std::array<Key*,fanout+1> bounds;
+		page.head.leaf = 0;
+		page.head.count = splits;
+		partition( page, 0, first, last, depth, bounds );
+	}
+
+	// Child of an internal page that a key goes to. equal is set to the
+	// index of a split equal to the key, or to splits if there is none.
+	static std::size_t route( const internal_page& page, const std::array<Key,splits>& keys,
+	                          const Key& k, std::size_t& equal )
+	{
+		std::size_t index = 0;
+		equal = splits;
+		while( index < splits ) {
+			const std::size_t d = page.nodes[index].discriminant;
+			if( k == keys[index] )
+				equal = index;
+			index = split_less( d, k, keys[index] )? 2*index+1 : 2*index+2;
+		}
+		return index - splits;
+	}
+
+	// Child pages of an internal page that may hold matching keys.
+	// choose(split, left, right) sets which sides of a split to follow.
+	template < typename Choose >
+	static void select( const internal_page& page, Choose choose, std::vector<page_id>& out,
+	                    std::size_t index = 0 )
+	{
+		if( index >= splits ) {
+			page_id child = page.children[index - splits];
+			if( child != no_page )
+				out.push_back( child );
+			return;
+		}
+		bool left = false;
+		bool right = false;
+		choose( page.nodes[index], left, right );
+		if( left )
+			select( page, choose, out, 2*index+1 );
+		if( right )
+			select( page, choose, out, 2*index+2 );
+	}
+
+	private:
+		static std::size_t subtree_pages( std::size_t n, std::size_t levels )
+		{
+			if( levels == 0 )
+				return pages( n );
+			return subtree_pages( n/2, levels-1 ) + subtree_pages( n - n/2, levels-1 );
+		}
+
+		static page_id build( page_file& file, std::vector<char>& buffer, page_id& next,
+		                      Key* first, Key* last, std::size_t depth )
+		{
+			const std::size_t n = last - first;
+			std::fill( buffer.begin(), buffer.end(), 0 );
+
+			if( n <= leaf_capacity ) {
+				leaf_page leaf = leaf_page();
+				leaf.head.leaf = 1;
+				leaf.head.count = n;
+				for( std::size_t i = 0; i < n; i++ )
+					leaf.keys[i] = record( first[i] );
+				std::memcpy( buffer.data(), &leaf, sizeof(leaf) );
+				file.write( next, buffer.data() );
+				return next++;
+			}
+
+			// Split in-page levels first, then write children, then ourselves
+			internal_page page = internal_page();
+			page.head.leaf = 0;
+			page.head.count = splits;
+			std::array<Key*,fanout+1> bounds;
+			partition( page, 0, first, last, depth, bounds );
+			bounds[fanout] = last;
+
+			for( std::size_t child = 0; child < fanout; child++ ) {
+				if( bounds[child] == bounds[child+1] )
+					page.children[child] = no_page;
+				else
+					page.children[child] = build( file, buffer, next,
+						bounds[child], bounds[child+1], depth + height );
+			}
+
+			std::fill( buffer.begin(), buffer.end(), 0 );
+			std::memcpy( buffer.data(), &page, sizeof(page) );
+			file.write( next, buffer.data() );
+			return next++;
+		}
+
+		// Median split of [first,last) for in-page node index
+		static void partition( internal_page& page, std::size_t index,
+		                       Key* first, Key* last, std::size_t depth,
+		                       std::array<Key*,fanout+1>& bounds )
+		{
+			if( index >= splits ) {
+				bounds[index - splits] = first;
+				return;
+			}
+
+			const std::size_t d = depth % D;
+			Key* middle = first + (last - first)/2;
+			split& node = page.nodes[index];
+			node.discriminant = d;
+			if( first != last ) {
+				std::nth_element( first, middle, last,
+					[d]( const Key& lhs, const Key& rhs ) {
+						return split_less( d, lhs, rhs );
+					} );
+				node.key = record( *middle );
+			} else {
+				node.key = record( Key() );
+			}
+
+			partition( page, 2*index+1, first, middle, depth+1, bounds );
+			partition( page, 2*index+2, middle, last, depth+1, bounds );
+		}
+};
+
+} // namespace detail
+} // namespace ads
+
+#endif // PAGED_KDTREE_NODE
@@ -23,6 +23,12 @@
 #include "kdtree_common.hpp"
 #include "kdtree_traits.hpp"
 
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
 namespace ads {
 namespace detail {
 
@@ -58,7 +64,7 @@ struct forward_partial_match
 		using next_level = forward_partial_match<Node,d-1>;
 
 		std::list<const Key*> list;
-		if( m[d] ) {
+		if( !m[d] ) {
 			list =
 				next_level()( node, k, m, position | 0<<d );
 			list.splice( list.begin(),
@@ -72,7 +78,7 @@ struct forward_partial_match
 };
 
 template< typename Node >
-struct forward_partial_match<Node,-1>
+struct forward_partial_match<Node,std::size_t(-1)>
 {
 	typedef typename Node::Key  Key;
 	typedef typename Node::Mask Mask;
@@ -87,7 +93,7 @@ struct forward_partial_match<Node,-1>
 	}
 };
 
-template < typename T >
+template < typename T, typename Allocator = std::allocator<T> >
 struct quadtree_node
 {
 	// Constants
@@ -95,25 +101,22 @@ struct quadtree_node
 
 	// Type members
 	typedef T                            Key;
+	typedef Allocator                    allocator_type;
 	typedef mask_type<T>                 Mask;
-	typedef quadtree_node<T>             Node;
+	typedef quadtree_node<T,Allocator>   Node;
 	typedef std::array<Node*,power(2ul,D)> SuccessorTable;
 
-	quadtree_node( const Key& k ) :
+	template < typename K >
+	explicit quadtree_node( K&& k ) :
 		_successors(),
-		_key(k)
+		_key(std::forward<K>(k))
 	{
 	}
 
-	~quadtree_node()
-	{
-		for( Node* successor: _successors )
-			if( successor )
-				delete successor;
-	}
-
 	// Function members
-	bool insert( const Key& k )
+	// k is only copied or moved into the new node
+	template < typename K >
+	bool insert( K&& k, Allocator& alloc )
 	{
 		bool inserted = false;
 		std::size_t pos = find_position<Key>()(_key,k);
@@ -122,14 +125,23 @@ struct quadtree_node
 		if( pos == 0 && _key == k ) {
 			inserted = false;
 		} else if( _successors[pos] ) {
-			inserted = _successors[pos]->insert(k);
+			inserted = _successors[pos]->insert(std::forward<K>(k), alloc);
 		} else {
-			_successors[pos] = new quadtree_node(k);
+			_successors[pos] = create_node(std::forward<K>(k), alloc);
 			inserted = true;
 		}
 		return inserted;
 	}
 
+	// Moves every key of the subtree into keys
+	void extract( std::vector<Key>& keys )
+	{
+		keys.push_back( std::move(_key) );
+		for( Node* successor: _successors )
+			if( successor )
+				successor->extract( keys );
+	}
+
 	// Exact search
 	const Key* find( const Key& k ) const
 	{
@@ -144,7 +156,7 @@ struct quadtree_node
 	}
 
 	// Partial match
-	std::list<const Key*> find( const Key& k, const Mask& m )
+	std::list<const Key*> find( const Key& k, const Mask& m ) const
 	{
 		std::list<const Key*> list;
 		if( matches_partially<Key>()( _key, k, m ) ) {
@@ -152,13 +164,53 @@ struct quadtree_node
 		}
 
 		list.splice( list.begin(),
-			forward_partial_match<Node>()( _key, k, m ) );
+			forward_partial_match<Node>()( *this, k, m ) );
 		return list;
 	}
 
-	static Node* create_node( const Key& k )
+	// Partial match with a compile-time mask
+	template< unsigned long long MaskBits >
+	std::list<const Key*> find( const Key& k ) const
 	{
-		return new quadtree_node<Key>(k);
+		return find( k, Mask(MaskBits) );
+	}
+
+	template < typename K >
+	static Node* create_node( K&& k, Allocator& alloc )
+	{
+		return allocate_node<Node>( alloc, std::forward<K>(k) );
+	}
+
+	// Destroys a whole subtree
+	static void destroy_node( Node* node, Allocator& alloc )
+	{
+		if( node ) {
+			for( Node* successor: node->_successors )
+				destroy_node( successor, alloc );
+			deallocate_node( alloc, node );
+		}
+	}
+
+	// Builds a subtree from the distinct keys [first,last), which are
+	// moved into the nodes. Point quadtrees have no median split, keys
+	// are inserted in random order to keep the expected depth logarithmic.
+	static Node* build( Key* first, Key* last, Allocator& alloc )
+	{
+		if( first == last )
+			return nullptr;
+
+		static std::default_random_engine gen;
+		std::shuffle( first, last, gen );
+
+		Node* root = create_node( std::move(*first), alloc );
+		try {
+			for( Key* k = first+1; k != last; ++k )
+				root->insert( std::move(*k), alloc );
+		} catch( ... ) {
+			destroy_node( root, alloc );
+			throw;
+		}
+		return root;
 	}
 
 	// Data members
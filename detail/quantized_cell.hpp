@@ -0,0 +1,75 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef QUANTIZED_CELL
+#define QUANTIZED_CELL
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+namespace ads {
+namespace detail {
+
+// Quantization of coordinates relative to a cell [lo,hi] of a dimension.
+//
+// The cell is split in M = max(Code) equal slices and a coordinate v is
+// stored as the slice c such that bound(c) <= v <= bound(c+1). Slice
+// bounds are always computed by the same expression, so bounds obtained
+// while searching are bitwise equal to the ones used while encoding and
+// a slice always contains the coordinate it encodes.
+template < typename Code >
+struct cell_quantizer
+{
+	static_assert( std::is_integral<Code>::value && std::is_unsigned<Code>::value,
+	               "Codes must be unsigned integers" );
+
+	static constexpr std::size_t slices = std::numeric_limits<Code>::max();
+
+	// Lower bound of slice c, bound(slices) is hi
+	static double bound( double lo, double hi, std::size_t c )
+	{
+		return c < slices? lo + (hi - lo) * static_cast<double>(c) / slices : hi;
+	}
+
+	// Assumes lo <= v <= hi
+	static Code encode( double lo, double hi, double v )
+	{
+		if( !( lo < hi ) )
+			return 0;
+
+		double scaled = std::floor( (v - lo) / (hi - lo) * slices );
+		std::size_t c = scaled < 0.0? 0 :
+			std::min<std::size_t>( static_cast<std::size_t>(scaled), slices-1 );
+
+		// Fix rounding errors of the division
+		while( c > 0 && v < bound( lo, hi, c ) )
+			c--;
+		while( c < slices-1 && bound( lo, hi, c+1 ) < v )
+			c++;
+		return static_cast<Code>(c);
+	}
+};
+
+} // namespace detail
+} // namespace ads
+
+#endif // QUANTIZED_CELL
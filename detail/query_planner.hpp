@@ -0,0 +1,262 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef QUERY_PLANNER
+#define QUERY_PLANNER
+
+#include "kdtree_common.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <tuple>
+#include <vector>
+
+namespace ads {
+namespace detail {
+
+// Copy of the keys stored one dimension per array, so that a filter on
+// a dimension is a plain loop over contiguous values that the compiler
+// can vectorize. Filters clear flags[i] when row i does not match.
+template < typename T, std::size_t I = std::tuple_size<T>::value-1 >
+struct column_store : public column_store<T,I-1>
+{
+	typedef column_store<T,I-1>                       Base;
+	typedef typename std::tuple_element<I,T>::type    Value;
+
+	void push_back( const T& key )
+	{
+		Base::push_back( key );
+		_column.push_back( std::get<I>(key) );
+	}
+
+	void filter( const T& lower, const T& upper, std::vector<unsigned char>& flags ) const
+	{
+		Base::filter( lower, upper, flags );
+		const Value lo = std::get<I>(lower);
+		const Value hi = std::get<I>(upper);
+		const std::size_t n = _column.size();
+		for( std::size_t i = 0; i < n; i++ )
+			flags[i] &= !( _column[i] < lo ) & !( hi < _column[i] );
+	}
+
+	void filter( const T& key, const mask_type<T>& mask, std::vector<unsigned char>& flags ) const
+	{
+		Base::filter( key, mask, flags );
+		if( !mask[I] )
+			return;
+		const Value value = std::get<I>(key);
+		const std::size_t n = _column.size();
+		for( std::size_t i = 0; i < n; i++ )
+			flags[i] &= _column[i] == value;
+	}
+
+	std::vector<Value> _column;
+};
+
+template < typename T >
+struct column_store<T,0>
+{
+	typedef typename std::tuple_element<0,T>::type Value;
+
+	void push_back( const T& key )
+	{
+		_column.push_back( std::get<0>(key) );
+	}
+
+	void filter( const T& lower, const T& upper, std::vector<unsigned char>& flags ) const
+	{
+		const Value lo = std::get<0>(lower);
+		const Value hi = std::get<0>(upper);
+		const std::size_t n = _column.size();
+		for( std::size_t i = 0; i < n; i++ )
+			flags[i] &= !( _column[i] < lo ) & !( hi < _column[i] );
+	}
+
+	void filter( const T& key, const mask_type<T>& mask, std::vector<unsigned char>& flags ) const
+	{
+		if( !mask[0] )
+			return;
+		const Value value = std::get<0>(key);
+		const std::size_t n = _column.size();
+		for( std::size_t i = 0; i < n; i++ )
+			flags[i] &= _column[i] == value;
+	}
+
+	std::vector<Value> _column;
+};
+
+enum class query_strategy
+{
+	tree, //!< Traverse the tree
+	scan  //!< Filter the column copy of every key
+};
+
+struct query_plan
+{
+	query_strategy strategy;
+	double selectivity; //!< Estimated fraction of keys that match
+	double tree_cost;   //!< Estimated cost of the traversal
+	double scan_cost;   //!< Estimated cost of the scan
+};
+
+// Chooses how to run range and partial match queries.
+//
+// Keeps a uniform sample of the inserted keys (reservoir sampling) and,
+// per dimension, a sorted copy of the sampled coordinates: an equi-depth
+// histogram with one bucket per sampled key. From it, the fraction s(d)
+// of keys passing the query condition on dimension d is found with two
+// binary searches. Descending a kd-tree, a split on dimension d is
+// crossed on both sides with probability s(d), so a traversal visits
+// about prod_d (1+s(d))^(log2(n)/D) nodes. The scan always touches n
+// keys but, being sequential, each one is much cheaper.
+//
+// Histograms are only updated by insert(), so planning is read only and
+// may run concurrently with other queries.
+template < typename T >
+class query_planner
+{
+	public:
+		typedef T            Key;
+		typedef mask_type<T> Mask;
+
+		static constexpr std::size_t D = std::tuple_size<T>::value;
+
+		//! Cost of visiting a tree node, relative to scanning a key
+		static constexpr double node_cost = 8.0;
+
+		explicit query_planner( std::size_t sample_size = 256 ) :
+			_sample_size(sample_size),
+			_sample(),
+			_seen(0),
+			_gen(),
+			_changes(0),
+			_histograms()
+		{
+		}
+
+		void insert( const Key& k )
+		{
+			_seen++;
+			if( _sample.size() < _sample_size ) {
+				_sample.push_back( k );
+				_changes++;
+			} else {
+				std::uniform_int_distribution<std::size_t> dis( 0, _seen-1 );
+				std::size_t slot = dis( _gen );
+				if( slot < _sample_size ) {
+					_sample[slot] = k;
+					_changes++;
+				}
+			}
+			update_histograms();
+		}
+
+		// Orthogonal range search
+		query_plan plan( const Key& lower, const Key& upper ) const
+		{
+			Point lo, hi;
+			to_point<Key>()( lower, lo );
+			to_point<Key>()( upper, hi );
+
+			std::array<double,D> s;
+			for( std::size_t d = 0; d < D; d++ )
+				s[d] = fraction( d, lo[d], hi[d] );
+			return choose( s );
+		}
+
+		// Partial match
+		query_plan plan( const Key& key, const Mask& mask ) const
+		{
+			Point p;
+			to_point<Key>()( key, p );
+
+			std::array<double,D> s;
+			for( std::size_t d = 0; d < D; d++ )
+				s[d] = mask[d]? fraction( d, p[d], p[d] ) : 1.0;
+			return choose( s );
+		}
+
+	private:
+		typedef std::array<double,D> Point;
+
+		// Histograms are rebuilt once a sixteenth of the sample changed
+		void update_histograms()
+		{
+			if( _changes == 0 || _changes < _sample.size()/16 )
+				return;
+			_changes = 0;
+
+			Point p;
+			for( std::size_t d = 0; d < D; d++ )
+				_histograms[d].clear();
+			for( const Key& k : _sample ) {
+				to_point<Key>()( k, p );
+				for( std::size_t d = 0; d < D; d++ )
+					_histograms[d].push_back( p[d] );
+			}
+			for( std::size_t d = 0; d < D; d++ )
+				std::sort( _histograms[d].begin(), _histograms[d].end() );
+		}
+
+		// Estimated fraction of keys with lo <= key(d) <= hi. Never zero,
+		// a condition that no sampled key meets may still match a few keys.
+		double fraction( std::size_t d, double lo, double hi ) const
+		{
+			const std::vector<double>& h = _histograms[d];
+			std::size_t count = std::upper_bound( h.begin(), h.end(), hi )
+			                  - std::lower_bound( h.begin(), h.end(), lo );
+			return ( count + 0.5 ) / ( h.size() + 1.0 );
+		}
+
+		query_plan choose( const std::array<double,D>& s ) const
+		{
+			const double n = static_cast<double>(_seen);
+			const double levels = std::log2( n + 1.0 );
+
+			double visited = 1.0;
+			double matching = 1.0;
+			for( std::size_t d = 0; d < D; d++ ) {
+				visited *= std::pow( 1.0 + s[d], levels / D );
+				matching *= s[d];
+			}
+
+			query_plan plan;
+			plan.selectivity = matching;
+			plan.tree_cost = node_cost * std::min( visited, n );
+			plan.scan_cost = n;
+			plan.strategy = plan.scan_cost < plan.tree_cost?
+				query_strategy::scan : query_strategy::tree;
+			return plan;
+		}
+
+		std::size_t _sample_size;
+		std::vector<Key> _sample;
+		std::size_t _seen;
+		std::default_random_engine _gen;
+		std::size_t _changes; //!< Sample updates since last rebuild
+		std::array<std::vector<double>,D> _histograms;
+};
+
+} // namespace detail
+} // namespace ads
+
+#endif // QUERY_PLANNER
@@ -20,20 +20,27 @@
 #ifndef RELAXED_KDTREE_NODE
 #define RELAXED_KDTREE_NODE
 
+#include "batch_query.hpp"
 #include "kdtree_common.hpp"
 #include "kdtree_traits.hpp"
+#include "knearest_search.hpp"
+#include "lazy_search.hpp"
 
+#include <algorithm>
 #include <array>
 #include <list>
+#include <memory>
 #include <random>
 #include <stdexcept>
 #include <tuple>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace ads {
 namespace detail {
 
-template < typename T >
+template < typename T, typename Allocator = std::allocator<T> >
 struct relaxed_kdtree_node_base
 {
 	// Constants
@@ -41,28 +48,28 @@ struct relaxed_kdtree_node_base
 	static constexpr std::size_t D = std::tuple_size<T>::value; 
 
 	// Type members
-	typedef T                           Key;
-	typedef relaxed_kdtree_node_base<T> Node;
-	typedef std::array<Node*,2>         SuccessorTable;
+	typedef T                                     Key;
+	typedef Allocator                             allocator_type;
+	typedef relaxed_kdtree_node_base<T,Allocator> Node;
+	typedef std::array<Node*,2>                   SuccessorTable;
 
 	// Member functions
 	// Constructors
-	relaxed_kdtree_node_base( const Key& key ) :
+	template < typename K >
+	explicit relaxed_kdtree_node_base( K&& key ) :
 		_successors(),
-		_key(key)
+		_key(std::forward<K>(key))
 	{
 	}
 
 	virtual ~relaxed_kdtree_node_base()
 	{
-		for( Node* successor: _successors ) {
-			if( successor )
-				delete successor;
-		}
 	}
 
 	const Key& getKey() const { return _key; }
 
+	virtual std::size_t getDiscriminant() const = 0;
+
 	Node* getSuccessor( std::size_t position ) const noexcept
 	{
 		return _successors[position];
@@ -75,7 +82,23 @@ struct relaxed_kdtree_node_base
 		return std::get<position>(_successors);
 	}
 
-	virtual bool insert( const Key& k2 ) = 0;
+	// Insertion
+	// k2 is only copied or moved into the new node
+	virtual bool insert( const Key& k2, Allocator& alloc ) = 0;
+	virtual bool insert( Key&& k2, Allocator& alloc ) = 0;
+
+	// Moves every key of the subtree into keys
+	void extract( std::vector<Key>& keys )
+	{
+		keys.push_back( std::move(_key) );
+		for( Node* successor: _successors ) {
+			if( successor )
+				successor->extract( keys );
+		}
+	}
+
+	// Destroys the subtree, nodes are deallocated with their own type
+	virtual void destroy( Allocator& alloc ) = 0;
 
 	// Exact search
 	virtual const Key* find( const Key& k2 ) const = 0;
@@ -83,30 +106,69 @@ struct relaxed_kdtree_node_base
 	// Partial match
 	virtual std::list<const Key*> find( const Key& k2, const mask_type<Key>& mask ) const = 0;
 
+	// Partial match with a compile-time mask
+	// Discriminants are only known at run time, so this forwards
+	// to the dynamic mask version.
+	template< unsigned long long MaskBits >
+	std::list<const Key*> find( const Key& k2 ) const
+	{
+		return find( k2, mask_type<Key>(MaskBits) );
+	}
+
 	// Orthogonal range seach
 	// Assumes lower(i) <= upper(i) for all i = [0,D-1]
 	virtual std::list<const Key*> find( const Key& lower, const Key& upper ) const = 0;
 
+	// Batch exact search
+	virtual void find( const std::vector<Key>& keys, std::size_t* first, std::size_t* last,
+	                   std::size_t* scratch, std::vector<const Key*>& found ) const = 0;
+
+	// Batch orthogonal range search
+	virtual void find( const std::vector<box_type<Key> >& boxes, std::size_t* first, std::size_t* last,
+	                   std::size_t* scratch, std::vector<std::list<const Key*> >& found ) const = 0;
+
+	// Lazy search steps
+	virtual const Key* step( range_cursor<Key>& cursor ) const = 0;
+	virtual const Key* step( partial_cursor<Key>& cursor ) const = 0;
+
+	// Nearest neighbour search step
+	virtual void find_nearest( knearest_search<Key>& search, double bound ) const = 0;
+
 	// Data members
 	SuccessorTable _successors; //!< Contains a pointer for two successors (binary tree)
 	Key _key; //!< Contains the stored key
 
-	static Node* create_node( const Key& k );
+	// Nodes get a random discriminant
+	template < typename K >
+	static Node* create_node( K&& k, Allocator& alloc );
+
+	static void destroy_node( Node* node, Allocator& alloc )
+	{
+		if( node )
+			node->destroy( alloc );
+	}
+
+	// Builds a balanced subtree from the distinct keys [first,last),
+	// which are moved into the nodes. The root discriminant is random
+	// and its median key becomes the root.
+	static Node* build( Key* first, Key* last, Allocator& alloc );
 };
 
-template < typename T, std::size_t discriminant = std::tuple_size<T>::value-1 >
-struct relaxed_kdtree_node : public relaxed_kdtree_node_base<T> {
+template < typename T, std::size_t discriminant = std::tuple_size<T>::value-1,
+           typename Allocator = std::allocator<T> >
+struct relaxed_kdtree_node : public relaxed_kdtree_node_base<T,Allocator> {
 	static_assert( discriminant < std::tuple_size<T>::value, "Discriminant value out of range" );
 	static_assert( 0 <= discriminant, "Discriminant value out of range" );
 
 	// Member types
-	typedef relaxed_kdtree_node_base<T> Base;
-	typedef T                           Key;
+	typedef relaxed_kdtree_node_base<T,Allocator> Base;
+	typedef T                                     Key;
 
 	// Member functions
 	// Constructor
-	relaxed_kdtree_node( const Key& key ) :
-		Base( key )
+	template < typename K >
+	explicit relaxed_kdtree_node( K&& key ) :
+		Base( std::forward<K>(key) )
 	{
 	}
 
@@ -114,26 +176,27 @@ struct relaxed_kdtree_node : public relaxed_kdtree_node_base<T> {
 	{
 	}
 
-	virtual bool insert( const Key& k2 )
+	virtual std::size_t getDiscriminant() const
 	{
-		bool inserted = false;
-		const Key& k1 = this->getKey();
-		if( std::get<discriminant>(k1) < std::get<discriminant>(k2) ) {
-			if( this->_successors[0] ) {
-				inserted = this->_successors[0]->insert(k2);
-			} else {
-				this->_successors[0] = Base::create_node(k2);
-				inserted = true;
-			}
-		} else if( k1 != k2 ) {
-			if( this->_successors[1] ) {
-				inserted = this->_successors[1]->insert(k2);
-			} else {
-				this->_successors[1] = Base::create_node(k2);
-				inserted = true;
-			}
+		return discriminant;
+	}
+
+	virtual bool insert( const Key& k2, Allocator& alloc )
+	{
+		return insert_key( k2, alloc );
+	}
+
+	virtual bool insert( Key&& k2, Allocator& alloc )
+	{
+		return insert_key( std::move(k2), alloc );
+	}
+
+	virtual void destroy( Allocator& alloc )
+	{
+		for( Base* successor: this->_successors ) {
+			Base::destroy_node( successor, alloc );
 		}
-		return inserted;
+		deallocate_node( alloc, this );
 	}
 
 	// Exact search
@@ -162,7 +225,7 @@ struct relaxed_kdtree_node : public relaxed_kdtree_node_base<T> {
 		std::list<const Key*> list;
 		const Key& k1 = this->getKey();
 
-		const bool ignore_dimension = mask[discriminant];
+		const bool ignore_dimension = !mask[discriminant];
 		const bool left = ignore_dimension
 		               || std::get<discriminant>(k1) < std::get<discriminant>(k2);
 		const bool right = ignore_dimension || !left;
@@ -173,7 +236,7 @@ struct relaxed_kdtree_node : public relaxed_kdtree_node_base<T> {
 		if( left && this->_successors[0] ) {
 			list.splice( list.begin(), this->_successors[0]->find(k2, mask) );
 		}
-		if( left && this->_successors[1] ) {
+		if( right && this->_successors[1] ) {
 			list.splice( list.begin(), this->_successors[1]->find(k2, mask) );
 		}
 		return list;
@@ -185,58 +248,217 @@ struct relaxed_kdtree_node : public relaxed_kdtree_node_base<T> {
 		std::list<const Key*> list;
 		const Key& k1 = this->getKey();
 
-		bool left = std::get<discriminant>(lower) <= std::get<discriminant>(k1);
-		bool right = std::get<discriminant>(k1) <= std::get<discriminant>(upper);
+		bool left = std::get<discriminant>(k1) < std::get<discriminant>(upper);
+		bool right = std::get<discriminant>(lower) <= std::get<discriminant>(k1);
 
-		if( left || right ) {
+		if( in_range<Key>()( k1, lower, upper ) ) {
 			list.push_back( &k1 );
 		}
 		if( left && this->_successors[0] ) {
 			list.splice( list.begin(), this->_successors[0]->find( lower, upper ) );
 		}
 		if( right && this->_successors[1] ) {
-			list.splice( list.begin(), this->_successors[0]->find( lower, upper ) );
+			list.splice( list.begin(), this->_successors[1]->find( lower, upper ) );
 		}
+		return list;
+	}
+
+	// Batch exact search
+	virtual void find( const std::vector<Key>& keys, std::size_t* first, std::size_t* last,
+	                   std::size_t* scratch, std::vector<const Key*>& found ) const
+	{
+		const Key& k1 = this->getKey();
+		std::size_t* left = first;
+		std::size_t* right = scratch;
+		for( std::size_t* it = first; it != last; ++it ) {
+			const Key& k2 = keys[*it];
+			if( std::get<discriminant>(k1) < std::get<discriminant>(k2) )
+				*left++ = *it;
+			else if( k1 == k2 )
+				found[*it] = &k1;
+			else
+				*right++ = *it;
+		}
+		std::size_t* middle = left;
+		std::size_t* end = std::copy( scratch, right, middle );
+		if( first != middle && this->_successors[0] )
+			this->_successors[0]->find( keys, first, middle, scratch, found );
+		if( middle != end && this->_successors[1] )
+			this->_successors[1]->find( keys, middle, end, scratch, found );
+	}
+
+	// Batch orthogonal range search
+	virtual void find( const std::vector<box_type<Key> >& boxes, std::size_t* first, std::size_t* last,
+	                   std::size_t* scratch, std::vector<std::list<const Key*> >& found ) const
+	{
+		const Key& k1 = this->getKey();
+		auto goes_left = [&]( std::size_t i ) {
+			return std::get<discriminant>(k1) < std::get<discriminant>(boxes[i].second);
+		};
+		auto goes_right = [&]( std::size_t i ) {
+			return std::get<discriminant>(boxes[i].first) <= std::get<discriminant>(k1);
+		};
+
+		for( std::size_t* it = first; it != last; ++it )
+			if( in_range<Key>()( k1, boxes[*it].first, boxes[*it].second ) )
+				found[*it].push_back( &k1 );
+
+		std::pair<std::size_t*,std::size_t*> parts = partition_batch( first, last, scratch, goes_left, goes_right );
+		std::size_t* right = parts.first;
+		if( first != parts.second && this->_successors[0] ) {
+			this->_successors[0]->find( boxes, first, parts.second, scratch, found );
+			right = gather_batch( first, parts.second, scratch, goes_right );
+		}
+		if( right != last && this->_successors[1] )
+			this->_successors[1]->find( boxes, right, last, scratch, found );
+	}
+
+	// Lazy orthogonal range search step
+	virtual const Key* step( range_cursor<Key>& cursor ) const
+	{
+		const Key& k1 = this->getKey();
+		const range_query<Key>& q = cursor.query();
+		if( std::get<discriminant>(k1) < std::get<discriminant>(q.upper) )
+			cursor.push( this->_successors[0] );
+		if( std::get<discriminant>(q.lower) <= std::get<discriminant>(k1) )
+			cursor.push( this->_successors[1] );
+		return in_range<Key>()( k1, q.lower, q.upper )? &k1 : nullptr;
+	}
+
+	// Lazy partial match step
+	virtual const Key* step( partial_cursor<Key>& cursor ) const
+	{
+		const Key& k1 = this->getKey();
+		const partial_query<Key>& q = cursor.query();
+		const bool ignore_dimension = !q.mask[discriminant];
+		const bool left = ignore_dimension
+		               || std::get<discriminant>(k1) < std::get<discriminant>(q.key);
+		const bool right = ignore_dimension || !left;
+
+		if( left )
+			cursor.push( this->_successors[0] );
+		if( right )
+			cursor.push( this->_successors[1] );
+		return matches_partially<Key>()( k1, q.key, q.mask )? &k1 : nullptr;
+	}
+
+	// Nearest neighbour search step
+	virtual void find_nearest( knearest_search<Key>& search, double bound ) const
+	{
+		const Key& k1 = this->getKey();
+		const Key& q = search.query();
+		const double diff = static_cast<double>(std::get<discriminant>(q))
+		                  - static_cast<double>(std::get<discriminant>(k1));
+		const std::size_t near = std::get<discriminant>(k1) < std::get<discriminant>(q)? 0 : 1;
+
+		search.consider( k1 );
+		search.push( this->_successors[near], bound );
+		search.push( this->_successors[1-near], std::max(bound, diff*diff) );
 	}
 
-	static Base* create_node( const T& k, std::size_t discr, std::true_type );
-	static Base* create_node( const T& k, std::size_t discr, std::false_type );
+	template < typename K >
+	static Base* create_node( K&& k, Allocator& alloc, std::size_t discr, std::true_type );
+	template < typename K >
+	static Base* create_node( K&& k, Allocator& alloc, std::size_t discr, std::false_type );
+
+	private:
+		template < typename K >
+		bool insert_key( K&& k2, Allocator& alloc )
+		{
+			bool inserted = false;
+			const Key& k1 = this->getKey();
+			if( std::get<discriminant>(k1) < std::get<discriminant>(k2) ) {
+				if( this->_successors[0] ) {
+					inserted = this->_successors[0]->insert(std::forward<K>(k2), alloc);
+				} else {
+					this->_successors[0] = Base::create_node(std::forward<K>(k2), alloc);
+					inserted = true;
+				}
+			} else if( k1 != k2 ) {
+				if( this->_successors[1] ) {
+					inserted = this->_successors[1]->insert(std::forward<K>(k2), alloc);
+				} else {
+					this->_successors[1] = Base::create_node(std::forward<K>(k2), alloc);
+					inserted = true;
+				}
+			}
+			return inserted;
+		}
 };
 
-template< typename T, std::size_t Discr >
-relaxed_kdtree_node_base<T>* relaxed_kdtree_node<T,Discr>::create_node( const T& key, std::size_t discriminant, std::false_type )
+template< typename T, std::size_t Discr, typename Allocator >
+template< typename K >
+relaxed_kdtree_node_base<T,Allocator>* relaxed_kdtree_node<T,Discr,Allocator>::create_node( K&& key, Allocator& alloc, std::size_t discriminant, std::false_type )
 {
 	constexpr bool last_dimension = Discr == 1;
 	if( discriminant == Discr ) {
-		return static_cast<relaxed_kdtree_node_base<T>*>( new relaxed_kdtree_node<T,Discr>( key ) );
+		return static_cast<relaxed_kdtree_node_base<T,Allocator>*>(
+			allocate_node<relaxed_kdtree_node<T,Discr,Allocator> >( alloc, std::forward<K>(key) ) );
 	} else {
-		return relaxed_kdtree_node<T,Discr-1>::create_node( key, discriminant, std::integral_constant<bool,last_dimension>() );
+		return relaxed_kdtree_node<T,Discr-1,Allocator>::create_node( std::forward<K>(key), alloc, discriminant, std::integral_constant<bool,last_dimension>() );
 	}
 }
 
-template< typename T, std::size_t Discr >
-relaxed_kdtree_node_base<T>* relaxed_kdtree_node<T,Discr>::create_node( const T& key, std::size_t discriminant, std::true_type )
+template< typename T, std::size_t Discr, typename Allocator >
+template< typename K >
+relaxed_kdtree_node_base<T,Allocator>* relaxed_kdtree_node<T,Discr,Allocator>::create_node( K&& key, Allocator& alloc, std::size_t discriminant, std::true_type )
 {
 	if( discriminant == Discr ) {
-		return static_cast<relaxed_kdtree_node_base<T>*>( new relaxed_kdtree_node<T,Discr>( key ) );
+		return static_cast<relaxed_kdtree_node_base<T,Allocator>*>(
+			allocate_node<relaxed_kdtree_node<T,Discr,Allocator> >( alloc, std::forward<K>(key) ) );
 	} else {
 		throw std::invalid_argument( "Discriminant value unexpected. Valid values: [0, D-1]" );
 	}
 }
 
-template< typename T >
-relaxed_kdtree_node_base<T>* relaxed_kdtree_node_base<T>::create_node( const T& key )
+// Random discriminant for a new node
+template< std::size_t D >
+std::size_t random_discriminant()
 {
-	constexpr std::size_t max_dimension = relaxed_kdtree_node_base<T>::D-1;
-
 	// Instantiate random generator and set up uniform distribution;
 	static std::default_random_engine gen;
-	static std::uniform_int_distribution<> dis(0, max_dimension);
+	static std::uniform_int_distribution<std::size_t> dis(0, D-1);
 
 	// Relaxed kdtree discriminant is generated randomly
-	std::size_t discriminant = dis( gen );
+	return dis( gen );
+}
 
-	return relaxed_kdtree_node<T,max_dimension>::create_node( key, discriminant, std::false_type() );
+template< typename T, typename Allocator >
+template< typename K >
+relaxed_kdtree_node_base<T,Allocator>* relaxed_kdtree_node_base<T,Allocator>::create_node( K&& key, Allocator& alloc )
+{
+	constexpr std::size_t max_dimension = relaxed_kdtree_node_base<T,Allocator>::D-1;
+	std::size_t discriminant = random_discriminant<D>();
+	return relaxed_kdtree_node<T,max_dimension,Allocator>::create_node( std::forward<K>(key), alloc, discriminant, std::false_type() );
+}
+
+template< typename T, typename Allocator >
+relaxed_kdtree_node_base<T,Allocator>* relaxed_kdtree_node_base<T,Allocator>::build( T* first, T* last, Allocator& alloc )
+{
+	if( first == last )
+		return nullptr;
+
+	constexpr std::size_t max_dimension = relaxed_kdtree_node_base<T,Allocator>::D-1;
+	const std::size_t d = random_discriminant<D>();
+	auto less = [d]( const T& lhs, const T& rhs ) {
+		return less_in_dimension<T>()( d, lhs, rhs );
+	};
+	T* pivot = last-1;
+	std::nth_element( first, first + (last-first)/2, last, less );
+	std::iter_swap( first + (last-first)/2, pivot );
+	T* split = std::partition( first, pivot,
+		[&]( const T& k ) { return less( *pivot, k ); } );
+
+	Node* node = relaxed_kdtree_node<T,max_dimension,Allocator>::create_node(
+		std::move(*pivot), alloc, d, std::false_type() );
+	try {
+		node->_successors[0] = build( first, split, alloc );
+		node->_successors[1] = build( split, pivot, alloc );
+	} catch( ... ) {
+		destroy_node( node, alloc );
+		throw;
+	}
+	return node;
 }
 
 } // namespace detail
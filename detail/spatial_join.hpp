@@ -0,0 +1,190 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SPATIAL_JOIN
+#define SPATIAL_JOIN
+
+#include "kdtree_common.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <vector>
+
+namespace ads {
+namespace detail {
+
+// Dual-tree traversal reporting every pair of keys (a,b) with a
+// in one tree, b in the other one and distance(a,b) <= radius.
+//
+// Each step pairs two pieces, one from each tree. A piece is either a
+// whole subtree or only the key stored at its root, together with a
+// box that contains it. Pairs whose boxes are further apart than radius
+// are discarded at once; otherwise the shallower whole subtree is split
+// into its key and its two successors.
+template < typename T, typename Callback >
+class spatial_join_traversal
+{
+	public:
+		typedef T Key;
+
+		static constexpr std::size_t D = std::tuple_size<T>::value;
+
+		typedef std::array<double,D> Point;
+
+		struct region
+		{
+			Point lower;
+			Point upper;
+		};
+
+		typedef std::vector<std::function<void()> > TaskList;
+
+		// Tasks, if not null, collects the pairs reached at depth
+		// task_depth instead of traversing them.
+		spatial_join_traversal( double radius, Callback& callback,
+		                        TaskList* tasks = nullptr, std::size_t task_depth = 0 ) :
+			_radius(radius),
+			_squared_radius(radius*radius),
+			_callback(callback),
+			_tasks(tasks),
+			_task_depth(task_depth)
+		{
+		}
+
+		static region unbounded()
+		{
+			region r;
+			r.lower.fill( -std::numeric_limits<double>::infinity() );
+			r.upper.fill( std::numeric_limits<double>::infinity() );
+			return r;
+		}
+
+		template < typename NodeA, typename NodeB >
+		void join( const NodeA* a, const region& ra, bool whole_a, std::size_t depth_a,
+		           const NodeB* b, const region& rb, bool whole_b, std::size_t depth_b )
+		{
+			if( !a || !b || min_distance(ra, rb) > _squared_radius )
+				return;
+
+			if( !whole_a && !whole_b ) {
+				if( squared_distance<Key>()( a->getKey(), b->getKey() ) <= _squared_radius )
+					_callback( a->getKey(), b->getKey() );
+				return;
+			}
+
+			if( _tasks && depth_a + depth_b >= _task_depth ) {
+				const double radius = _radius;
+				Callback& callback = _callback;
+				_tasks->push_back( [=, &callback]() {
+					spatial_join_traversal( radius, callback ).join(
+						a, ra, whole_a, depth_a, b, rb, whole_b, depth_b );
+				} );
+				return;
+			}
+
+			if( whole_a && ( !whole_b || depth_a <= depth_b ) ) {
+				std::array<region,3> pieces = split( a, ra );
+				join( a, pieces[2], false, depth_a, b, rb, whole_b, depth_b );
+				join( a->_successors[0], pieces[0], true, depth_a+1, b, rb, whole_b, depth_b );
+				join( a->_successors[1], pieces[1], true, depth_a+1, b, rb, whole_b, depth_b );
+			} else {
+				std::array<region,3> pieces = split( b, rb );
+				join( a, ra, whole_a, depth_a, b, pieces[2], false, depth_b );
+				join( a, ra, whole_a, depth_a, b->_successors[0], pieces[0], true, depth_b+1 );
+				join( a, ra, whole_a, depth_a, b->_successors[1], pieces[1], true, depth_b+1 );
+			}
+		}
+
+	private:
+		// Squared distance between the closest points of two boxes
+		static double min_distance( const region& r1, const region& r2 )
+		{
+			double distance = 0.0;
+			for( std::size_t i = 0; i < D; i++ ) {
+				double gap = 0.0;
+				if( r1.upper[i] < r2.lower[i] )
+					gap = r2.lower[i] - r1.upper[i];
+				else if( r2.upper[i] < r1.lower[i] )
+					gap = r1.lower[i] - r2.upper[i];
+				distance += gap*gap;
+			}
+			return distance;
+		}
+
+		// Boxes for successor 0, successor 1 and the node key itself
+		template < typename Node >
+		static std::array<region,3> split( const Node* node, const region& r )
+		{
+			const std::size_t d = node->getDiscriminant();
+			Point key;
+			to_point<Key>()( node->getKey(), key );
+
+			std::array<region,3> pieces = {{ r, r, region{ key, key } }};
+			pieces[0].lower[d] = key[d]; // successor 0 keeps greater keys
+			pieces[1].upper[d] = key[d];
+			return pieces;
+		}
+
+		double _radius;
+		double _squared_radius;
+		Callback& _callback;
+		TaskList* _tasks;
+		std::size_t _task_depth;
+};
+
+template < typename T, typename NodeA, typename NodeB, typename Callback >
+void spatial_join( const NodeA* a, const NodeB* b, double radius, Callback& callback, std::size_t threads )
+{
+	typedef spatial_join_traversal<T,Callback> Traversal;
+	const typename Traversal::region everywhere = Traversal::unbounded();
+
+	if( threads <= 1 ) {
+		Traversal( radius, callback ).join( a, everywhere, true, 0, b, everywhere, true, 0 );
+		return;
+	}
+
+	// Each level splits a piece in three, aim for a few tasks per thread
+	std::size_t task_depth = 0;
+	for( std::size_t pairs = 1; pairs < 8*threads; pairs *= 3 )
+		task_depth++;
+
+	typename Traversal::TaskList tasks;
+	Traversal( radius, callback, &tasks, task_depth )
+		.join( a, everywhere, true, 0, b, everywhere, true, 0 );
+
+	std::atomic<std::size_t> next(0);
+	std::vector<std::thread> workers;
+	for( std::size_t t = 0; t < threads && t < tasks.size(); t++ ) {
+		workers.emplace_back( [&]() {
+			for( std::size_t i = next++; i < tasks.size(); i = next++ )
+				tasks[i]();
+		} );
+	}
+	for( std::thread& worker : workers )
+		worker.join();
+}
+
+} // namespace detail
+} // namespace ads
+
+#endif // SPATIAL_JOIN
@@ -22,8 +22,18 @@
 
 #include "detail/kdtree_traits.hpp"
 #include "detail/kdtree_node.hpp"
+#include "detail/external_kdtree_node.hpp"
 #include "detail/quadtree_node.hpp"
 #include "detail/relaxed_kdtree_node.hpp"
+#include "detail/query_planner.hpp"
+#include "detail/spatial_join.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
 
 namespace ads {
 
@@ -31,28 +41,90 @@ template < typename T,
 	typename Node,
 	typename = traits::require_kdtree_valid_datatype<T>
 	>
+class generic_kdtree;
+
+// Dual-tree spatial join
+// Calls callback(a,b) for every a in tree_a and b in tree_b such that
+// distance(a,b) <= radius. With threads > 1, callback must be safe to
+// call concurrently.
+template < typename T, typename NodeA, typename NodeB, typename Callback >
+void spatial_join( const generic_kdtree<T,NodeA>& tree_a,
+                   const generic_kdtree<T,NodeB>& tree_b,
+                   double radius, Callback callback, std::size_t threads = 1 );
+
+template < typename T,
+	typename Node,
+	typename
+	>
 class generic_kdtree
 {
 	public:
 		typedef T                    Key;
+		typedef typename Node::allocator_type Allocator;
 		typedef detail::mask_type<T> Mask;
+		typedef detail::box_type<T>  Box;
+		typedef detail::knearest_result<T> NearestResult;
+		typedef detail::lazy_view<Node, detail::range_cursor<T> >   RangeView;
+		typedef detail::lazy_view<Node, detail::partial_cursor<T> > PartialView;
 
-		generic_kdtree() :
-			_root(nullptr)
+		explicit generic_kdtree( const Allocator& alloc = Allocator() ) :
+			_root(nullptr),
+			_size(0),
+			_alloc(alloc)
 		{
 		}
 
-		generic_kdtree( std::initializer_list<Key> ilist ) :
-			_root(nullptr)
+		generic_kdtree( std::initializer_list<Key> ilist, const Allocator& alloc = Allocator() ) :
+			_root(nullptr),
+			_size(0),
+			_alloc(alloc)
 		{
 			for( const Key& item : ilist )
 				insert( item );
 		}
 
+		// Nodes are not shared, trees are moved instead of copied
+		generic_kdtree( const generic_kdtree& ) = delete;
+		generic_kdtree& operator=( const generic_kdtree& ) = delete;
+
+		generic_kdtree( generic_kdtree&& other ) noexcept :
+			_root(other._root),
+			_size(other._size),
+			_alloc(std::move(other._alloc))
+		{
+			other._root = nullptr;
+			other._size = 0;
+		}
+
+		// Nodes are taken over when both allocators can release them,
+		// otherwise keys are moved into nodes allocated by this tree.
+		generic_kdtree& operator=( generic_kdtree&& other )
+		{
+			typedef std::allocator_traits<Allocator> AllocTraits;
+			if( this == &other )
+				return *this;
+
+			clear();
+			if( AllocTraits::propagate_on_container_move_assignment::value ) {
+				_alloc = std::move(other._alloc);
+				steal( other );
+			} else if( _alloc == other._alloc ) {
+				steal( other );
+			} else {
+				std::vector<Key> keys = other.release();
+				rebuild( keys );
+			}
+			return *this;
+		}
+
 		~generic_kdtree()
 		{
-			if( _root )
-				delete _root;
+			clear();
+		}
+
+		Allocator get_allocator() const
+		{
+			return _alloc;
 		}
 
 		bool empty() const
@@ -60,16 +132,68 @@ class generic_kdtree
 			return !_root;
 		}
 
+		std::size_t size() const
+		{
+			return _size;
+		}
+
+		void clear()
+		{
+			Node::destroy_node( _root, _alloc );
+			_root = nullptr;
+			_size = 0;
+		}
+
 		bool insert( const Key& k )
 		{
-			bool inserted = false;
-			if( empty() ) {
-				_root = Node::create_node( k );
-				inserted = true;
-			} else {
-				inserted = _root->insert( k );
+			return insert_key( k );
+		}
+
+		bool insert( Key&& k )
+		{
+			return insert_key( std::move(k) );
+		}
+
+		// Constructs the key from args. Nodes are typed after their
+		// depth, so the key is built here once and moved into the node
+		// that is created for it, if any.
+		template < typename... Args >
+		bool emplace( Args&&... args )
+		{
+			return insert_key( Key( std::forward<Args>(args)... ) );
+		}
+
+		// Moves every key of other into this tree, leaving other empty.
+		// Keys already present are dropped. If this tree is empty, the
+		// nodes of other are taken over. Otherwise, for n keys here and m
+		// in other, the keys of other are moved in one by one when that
+		// is cheaper than a rebuild (m log(n+m) < n+m); only when the
+		// sizes are comparable is a balanced tree rebuilt from both.
+		void merge( generic_kdtree&& other )
+		{
+			if( this == &other || other.empty() )
+				return;
+
+			if( empty() && _alloc == other._alloc ) {
+				steal( other );
+				return;
 			}
-			return inserted;
+
+			const double n = static_cast<double>( _size + other._size );
+			std::vector<Key> others = other.release();
+			if( others.size() * std::log2( n ) < n ) {
+				for( Key& k : others )
+					insert_key( std::move(k) );
+				return;
+			}
+
+			std::vector<Key> keys = release();
+			keys.insert( keys.end(),
+			             std::make_move_iterator( others.begin() ),
+			             std::make_move_iterator( others.end() ) );
+			std::sort( keys.begin(), keys.end() );
+			keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+			rebuild( keys );
 		}
 
 		// Exact search
@@ -91,6 +215,18 @@ class generic_kdtree
 				return _root->find(k, mask);
 		}
 
+		// Partial match, mask given at compile time
+		// Bit i of MaskBits set means dimension i must match k.
+		template< unsigned long long MaskBits >
+		std::list<const Key*> find( const Key& k ) const
+		{
+			if( empty() )
+				// Return empty list
+				return std::list<const Key*>();
+			else
+				return _root->template find<MaskBits>(k);
+		}
+
 		// Orthogonal range seach
 		std::list<const Key*> find( const Key& lower, const Key& upper ) const
 		{
@@ -101,18 +237,295 @@ class generic_kdtree
 				return _root->find(lower, upper);
 		}
 
+		// Batch exact search
+		// Queries are sorted along a Z-order curve and pushed down the
+		// tree together; found[i] is the result for keys[i].
+		std::vector<const Key*> find( const std::vector<Key>& keys ) const
+		{
+			std::vector<const Key*> found( keys.size(), nullptr );
+			if( !empty() && !keys.empty() ) {
+				std::vector<std::size_t> batch = detail::morton_order( keys );
+				std::vector<std::size_t> scratch( batch.size() );
+				_root->find( keys, batch.data(), batch.data() + batch.size(), scratch.data(), found );
+			}
+			return found;
+		}
+
+		// Batch orthogonal range search, one (lower,upper) pair per query
+		std::vector<std::list<const Key*> > find( const std::vector<Box>& boxes ) const
+		{
+			std::vector<std::list<const Key*> > found( boxes.size() );
+			if( !empty() && !boxes.empty() ) {
+				std::vector<std::size_t> batch = detail::morton_order_boxes( boxes );
+				std::vector<std::size_t> scratch( batch.size() );
+				_root->find( boxes, batch.data(), batch.data() + batch.size(), scratch.data(), found );
+			}
+			return found;
+		}
+
+		// Lazy orthogonal range search
+		// Matches are found while the returned view is iterated.
+		RangeView range( const Key& lower, const Key& upper ) const
+		{
+			return RangeView( _root, detail::range_query<Key>{ lower, upper } );
+		}
+
+		// Lazy partial match
+		PartialView partial( const Key& k, const Mask& mask ) const
+		{
+			return PartialView( _root, detail::partial_query<Key>{ k, mask } );
+		}
+
+		// Approximate k nearest neighbours
+		// Returned keys are within a (1+epsilon) factor of the true
+		// k nearest distances, unless the search is cut short after
+		// expanding max_nodes nodes. Result reports if it is exact.
+		NearestResult approx_knearest( const Key& query, std::size_t k,
+		                               double epsilon = 0.0,
+		                               std::size_t max_nodes = std::numeric_limits<std::size_t>::max() ) const
+		{
+			detail::knearest_search<Key> search( query, k, epsilon, max_nodes );
+			return search.run( static_cast<const Node*>(_root) );
+		}
+
+	private:
+		template < typename U, typename NodeA, typename NodeB, typename Callback >
+		friend void spatial_join( const generic_kdtree<U,NodeA>&,
+		                          const generic_kdtree<U,NodeB>&,
+		                          double, Callback, std::size_t );
+
+		template < typename K >
+		bool insert_key( K&& k )
+		{
+			bool inserted = false;
+			if( empty() ) {
+				_root = Node::create_node( std::forward<K>(k), _alloc );
+				inserted = true;
+			} else {
+				inserted = _root->insert( std::forward<K>(k), _alloc );
+			}
+			_size += inserted;
+			return inserted;
+		}
+
+		// Takes over the nodes of other, this tree must be empty
+		void steal( generic_kdtree& other )
+		{
+			std::swap( _root, other._root );
+			std::swap( _size, other._size );
+		}
+
+		// Builds a balanced tree from distinct keys, this tree must be empty
+		void rebuild( std::vector<Key>& keys )
+		{
+			_root = Node::build( keys.data(), keys.data() + keys.size(), _alloc );
+			_size = keys.size();
+		}
+
+		// Moves the keys out and destroys every node
+		std::vector<Key> release()
+		{
+			std::vector<Key> keys;
+			if( _root )
+				_root->extract( keys );
+			clear();
+			return keys;
+		}
+
+		Node* _root;
+		std::size_t _size;
+		Allocator _alloc;
+};
+
+template < typename T, typename NodeA, typename NodeB, typename Callback >
+void spatial_join( const generic_kdtree<T,NodeA>& tree_a,
+                   const generic_kdtree<T,NodeB>& tree_b,
+                   double radius, Callback callback, std::size_t threads )
+{
+	detail::spatial_join<T>( static_cast<const NodeA*>(tree_a._root),
+	                         static_cast<const NodeB*>(tree_b._root),
+	                         radius, callback, threads );
+}
+
+// kd-tree that also keeps a column copy of its keys and, for every range
+// or partial match query, picks either a tree traversal or a scan of the
+// columns depending on the estimated cost (see detail::query_planner).
+template < typename T, typename Node = detail::kdtree_node<T> >
+class planned_kdtree
+{
+	public:
+		typedef T                        Key;
+		typedef detail::mask_type<T>     Mask;
+		typedef detail::query_plan       Plan;
+		typedef detail::query_strategy   Strategy;
+
+		planned_kdtree() :
+			_tree(),
+			_columns(),
+			_rows(),
+			_planner()
+		{
+		}
+
+		bool empty() const
+		{
+			return _tree.empty();
+		}
+
+		bool insert( const Key& k )
+		{
+			bool inserted = _tree.insert( k );
+			if( inserted ) {
+				_columns.push_back( k );
+				_rows.push_back( _tree.find( k ) );
+				_planner.insert( k );
+			}
+			return inserted;
+		}
+
+		// Exact search
+		const Key* find( const Key& k ) const
+		{
+			return _tree.find( k );
+		}
+
+		// Partial match
+		// If plan is not null, it receives the plan that was used.
+		std::list<const Key*> find( const Key& k, const Mask& mask, Plan* plan = nullptr ) const
+		{
+			const Plan chosen = _planner.plan( k, mask );
+			if( plan )
+				*plan = chosen;
+			if( chosen.strategy == Strategy::tree )
+				return _tree.find( k, mask );
+
+			std::vector<unsigned char> flags( _rows.size(), 1 );
+			_columns.filter( k, mask, flags );
+			return collect( flags );
+		}
+
+		// Orthogonal range seach
+		// If plan is not null, it receives the plan that was used.
+		std::list<const Key*> find( const Key& lower, const Key& upper, Plan* plan = nullptr ) const
+		{
+			const Plan chosen = _planner.plan( lower, upper );
+			if( plan )
+				*plan = chosen;
+			if( chosen.strategy == Strategy::tree )
+				return _tree.find( lower, upper );
+
+			std::vector<unsigned char> flags( _rows.size(), 1 );
+			_columns.filter( lower, upper, flags );
+			return collect( flags );
+		}
+
+	private:
+		std::list<const Key*> collect( const std::vector<unsigned char>& flags ) const
+		{
+			std::list<const Key*> list;
+			for( std::size_t i = 0; i < flags.size(); i++ )
+				if( flags[i] )
+					list.push_back( _rows[i] );
+			return list;
+		}
+
+		generic_kdtree<T,Node> _tree;
+		detail::column_store<T> _columns; //!< Keys, one array per dimension
+		std::vector<const Key*> _rows;    //!< Key in the tree for each column row
+		detail::query_planner<T> _planner;
+};
+
+// Index over data owned by someone else, e.g. columnar arrays.
+// Nodes only keep 32-bit row identifiers. Coordinates are obtained from
+// accessor(row, dimension), whose type is known at compile time so that
+// the call can be inlined. Queries return row identifiers.
+template < std::size_t D, typename Accessor >
+class external_kdtree
+{
+	public:
+		typedef detail::external_kdtree_node<Accessor,D> Node;
+		typedef typename Node::Row                        Row;
+		typedef typename Node::Value                      Value;
+		typedef typename Node::Point                      Point;
+		typedef typename Node::Mask                       Mask;
+
+		explicit external_kdtree( const Accessor& accessor = Accessor() ) :
+			_root(nullptr),
+			_accessor(accessor)
+		{
+		}
+
+		external_kdtree( const external_kdtree& ) = delete;
+		external_kdtree& operator=( const external_kdtree& ) = delete;
+
+		~external_kdtree()
+		{
+			if( _root )
+				delete _root;
+		}
+
+		bool empty() const
+		{
+			return !_root;
+		}
+
+		const Accessor& accessor() const { return _accessor; }
+
+		bool insert( Row r )
+		{
+			bool inserted = false;
+			if( empty() ) {
+				_root = Node::create_node( r );
+				inserted = true;
+			} else {
+				inserted = _root->insert( r, _accessor );
+			}
+			return inserted;
+		}
+
+		// Exact search
+		std::list<Row> find( const Point& p ) const
+		{
+			if( empty() )
+				// Return empty list
+				return std::list<Row>();
+			else
+				return _root->find(p, _accessor);
+		}
+
+		// Partial match
+		std::list<Row> find( const Point& p, const Mask& mask ) const
+		{
+			if( empty() )
+				// Return empty list
+				return std::list<Row>();
+			else
+				return _root->find(p, mask, _accessor);
+		}
+
+		// Orthogonal range seach
+		std::list<Row> find( const Point& lower, const Point& upper ) const
+		{
+			if( empty() )
+				// Return empty list
+				return std::list<Row>();
+			else
+				return _root->find(lower, upper, _accessor);
+		}
+
 	private:
 		Node* _root;
+		Accessor _accessor;
 };
 
-template < typename T >
-using relaxed_kdtree = generic_kdtree<T, detail::relaxed_kdtree_node_base<T> >;
+template < typename T, typename Allocator = std::allocator<T> >
+using relaxed_kdtree = generic_kdtree<T, detail::relaxed_kdtree_node_base<T,Allocator> >;
 
-template < typename T >
-using standard_kdtree = generic_kdtree<T, detail::kdtree_node<T> >;
+template < typename T, typename Allocator = std::allocator<T> >
+using standard_kdtree = generic_kdtree<T, detail::kdtree_node<T,0,Allocator> >;
 
-template < typename T >
-using quadtree = generic_kdtree<T, detail::quadtree_node<T> >;
+template < typename T, typename Allocator = std::allocator<T> >
+using quadtree = generic_kdtree<T, detail::quadtree_node<T,Allocator> >;
 
 } // namespace ads
 
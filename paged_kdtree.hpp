@@ -0,0 +1,543 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PAGED_KDTREE
+#define PAGED_KDTREE
+
+#include "detail/kdtree_traits.hpp"
+#include "detail/kdtree_common.hpp"
+#include "detail/page_file.hpp"
+#include "detail/paged_kdtree_node.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <list>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace ads {
+
+// Disk resident kd-tree for data sets larger than memory.
+//
+// Keys live in fixed size pages of a file and are read through a buffer
+// pool with CLOCK replacement. Pages are never updated in place: as in
+// the Bkd-tree, inserted keys are gathered in a small in-memory buffer
+// and, when it fills up, merged with the smaller static trees into a new
+// static tree (logarithmic method).
+//
+// Static trees are built out of core. Subtrees of up to memory_keys keys
+// are loaded and written page after page, children first. Larger ones
+// get an internal page whose splits are medians of a sample of their
+// keys; the keys are then streamed from disk into one run of pages per
+// child, and each child is built from its run. Memory use is bounded by
+// memory_keys keys plus one page per child of an internal page.
+//
+// Since pages may be evicted at any time, queries return copies of the
+// matching keys instead of pointers. Queries are const and may run
+// concurrently: the buffer pool synchronizes them, and a query waiting
+// for a page read does not block queries that hit other pages. Updates
+// may not run concurrently with anything else.
+template < typename T,
+	std::size_t PageSize = 4096,
+	typename = traits::require_kdtree_valid_datatype<T>
+	>
+class paged_kdtree
+{
+	public:
+		typedef T                    Key;
+		typedef detail::mask_type<T> Mask;
+
+		paged_kdtree( const std::string& path,
+		              std::size_t pool_pages = 256,
+		              std::size_t buffer_capacity = 1024,
+		              std::size_t memory_keys = 1 << 20 ) :
+			_file( path, PageSize ),
+			_pool( _file, pool_pages ),
+			_buffer_capacity( std::max<std::size_t>(buffer_capacity, 1) ),
+			_memory_keys( std::max( memory_keys, std::size_t(Layout::leaf_capacity) ) ),
+			_buffer(),
+			_levels(),
+			_free(),
+			_end(0),
+			_gen()
+		{
+		}
+
+		bool empty() const
+		{
+			return size() == 0;
+		}
+
+		std::size_t size() const
+		{
+			std::size_t n = _buffer.size();
+			for( const level& l : _levels )
+				n += l.size;
+			return n;
+		}
+
+		// Rebuilds the whole index as a single static tree holding the
+		// current keys plus [first,last). The new keys are streamed to
+		// disk first, they are never held in memory all at once.
+		template < typename InputIt >
+		void bulk_load( InputIt first, InputIt last )
+		{
+			run_writer writer( *this );
+			for( ; first != last; ++first )
+				writer.push( *first );
+			run input = writer.finish();
+
+			std::size_t n = input.size;
+			for( level& l : _levels ) {
+				n += l.size;
+				take( l, input );
+			}
+			std::vector<Key> keys;
+			keys.swap( _buffer );
+			n += keys.size();
+
+			std::size_t target = 0;
+			while( capacity(target) < n )
+				target++;
+			write_level( target, input, keys, n );
+		}
+
+		bool insert( const Key& k )
+		{
+			if( find( k ) )
+				return false;
+
+			_buffer.push_back( k );
+			if( _buffer.size() >= _buffer_capacity )
+				flush();
+			return true;
+		}
+
+		// Exact search
+		bool find( const Key& k ) const
+		{
+			if( std::find( _buffer.begin(), _buffer.end(), k ) != _buffer.end() )
+				return true;
+
+			bool found = false;
+			search(
+				[&k]( const split& s, bool& left, bool& right ) {
+					const Key key = s.key.load();
+					left = !less( s.discriminant, key, k );
+					right = !less( s.discriminant, k, key );
+				},
+				[&k,&found]( const Key& key ) {
+					found = found || key == k;
+					return !found;
+				},
+				false );
+			return found;
+		}
+
+		// Partial match
+		std::list<Key> find( const Key& k, const Mask& mask ) const
+		{
+			std::list<Key> list;
+			auto accept = [&k,&mask,&list]( const Key& key ) {
+				if( detail::matches_partially<Key>()( key, k, mask ) )
+					list.push_back( key );
+				return true;
+			};
+			std::for_each( _buffer.begin(), _buffer.end(), accept );
+			search(
+				[&k,&mask]( const split& s, bool& left, bool& right ) {
+					const bool ignore_dimension = !mask[s.discriminant];
+					const Key key = s.key.load();
+					left = ignore_dimension || !less( s.discriminant, key, k );
+					right = ignore_dimension || !less( s.discriminant, k, key );
+				},
+				accept, true );
+			return list;
+		}
+
+		// Orthogonal range search
+		// Assumes lower(i) <= upper(i) for all i = [0,D-1]
+		std::list<Key> find( const Key& lower, const Key& upper ) const
+		{
+			std::list<Key> list;
+			auto accept = [&lower,&upper,&list]( const Key& key ) {
+				if( detail::in_range<Key>()( key, lower, upper ) )
+					list.push_back( key );
+				return true;
+			};
+			std::for_each( _buffer.begin(), _buffer.end(), accept );
+			search(
+				[&lower,&upper]( const split& s, bool& left, bool& right ) {
+					const Key key = s.key.load();
+					left = !less( s.discriminant, key, lower );
+					right = !less( s.discriminant, upper, key );
+				},
+				accept, true );
+			return list;
+		}
+
+		const detail::buffer_pool& pool() const { return _pool; }
+
+		//! Pages currently used by the static trees
+		std::size_t pages() const
+		{
+			std::size_t n = 0;
+			for( const level& l : _levels )
+				for( const extent& e : l.extents )
+					n += e.pages;
+			return n;
+		}
+
+	private:
+		typedef detail::paged_kdtree_layout<T,PageSize> Layout;
+		typedef typename Layout::split                  split;
+		typedef typename Layout::record                 record;
+		typedef typename Layout::leaf_page              leaf_page;
+		typedef typename Layout::internal_page          internal_page;
+
+		struct extent
+		{
+			detail::page_id first;
+			std::size_t pages;
+		};
+
+		struct level
+		{
+			detail::page_id root;
+			std::size_t size;
+			std::vector<extent> extents;
+		};
+
+		// Pages holding keys to build a tree from. Internal pages of a
+		// static tree may be part of a run, they are skipped.
+		struct run
+		{
+			std::vector<extent> extents;
+			std::size_t size;
+		};
+
+		// Appends keys to a run, one leaf page at a time
+		class run_writer
+		{
+			public:
+				explicit run_writer( paged_kdtree& tree ) :
+					_tree(tree),
+					_page(),
+					_run{ std::vector<extent>(), 0 }
+				{
+					_page.head.leaf = 1;
+				}
+
+				void push( const Key& k )
+				{
+					_page.keys[_page.head.count++] = record( k );
+					_run.size++;
+					if( _page.head.count == Layout::leaf_capacity )
+						write();
+				}
+
+				run finish()
+				{
+					if( _page.head.count > 0 )
+						write();
+					return std::move(_run);
+				}
+
+			private:
+				void write()
+				{
+					std::vector<char> buffer( PageSize, 0 );
+					std::memcpy( buffer.data(), &_page, sizeof(_page) );
+					const detail::page_id p = _tree.allocate( 1 );
+					_tree._file.write( p, buffer.data() );
+					append( _run.extents, extent{ p, 1 } );
+					_page = leaf_page();
+					_page.head.leaf = 1;
+				}
+
+				paged_kdtree& _tree;
+				leaf_page _page;
+				run _run;
+		};
+
+		static bool less( std::size_t d, const Key& lhs, const Key& rhs )
+		{
+			return detail::less_in_dimension<Key>()( d, lhs, rhs );
+		}
+
+		// Adds pages to a list of extents, merging consecutive ones
+		static void append( std::vector<extent>& extents, const extent& e )
+		{
+			if( !extents.empty() && extents.back().first + extents.back().pages == e.first )
+				extents.back().pages += e.pages;
+			else
+				extents.push_back( e );
+		}
+
+		// Maximum number of keys held by a level
+		std::size_t capacity( std::size_t l ) const
+		{
+			return _buffer_capacity << l;
+		}
+
+		// Depth-first traversal of every static tree. choose selects the
+		// sides of each split to follow, accept is called for every key in
+		// the leaves reached and returns false to stop the search.
+		// With read_ahead, the pages about to be visited are prefetched.
+		template < typename Choose, typename Accept >
+		void search( Choose choose, Accept accept, bool read_ahead ) const
+		{
+			std::vector<detail::page_id> pending;
+			for( const level& l : _levels )
+				if( l.size > 0 )
+					pending.push_back( l.root );
+
+			while( !pending.empty() ) {
+				detail::page_id page = pending.back();
+				pending.pop_back();
+
+				detail::pinned_page pinned( _pool, page );
+				const leaf_page& leaf = pinned.as<leaf_page>();
+				if( leaf.head.leaf ) {
+					for( std::size_t i = 0; i < leaf.head.count; i++ )
+						if( !accept( leaf.keys[i].load() ) )
+							return;
+				} else {
+					const std::size_t before = pending.size();
+					Layout::select( pinned.as<internal_page>(), choose, pending );
+					if( read_ahead )
+						for( std::size_t i = before; i < pending.size(); i++ )
+							_pool.prefetch( pending[i] );
+				}
+			}
+		}
+
+		// Calls f for every key of a run, reading its pages sequentially
+		// without going through the buffer pool
+		template < typename F >
+		void for_each_key( const run& r, F f )
+		{
+			std::vector<char> buffer( PageSize );
+			leaf_page leaf;
+			for( const extent& e : r.extents ) {
+				for( std::size_t p = 0; p < e.pages; p++ ) {
+					_file.read( e.first + p, buffer.data() );
+					if( !Layout::head( buffer.data() ).leaf )
+						continue;
+					std::memcpy( &leaf, buffer.data(), sizeof(leaf) );
+					for( std::size_t i = 0; i < leaf.head.count; i++ )
+						f( leaf.keys[i].load() );
+				}
+			}
+		}
+
+		// Moves the pages of a level into a run, emptying the level
+		void take( level& l, run& r )
+		{
+			r.extents.insert( r.extents.end(), l.extents.begin(), l.extents.end() );
+			r.size += l.size;
+			l = level{ detail::no_page, 0, std::vector<extent>() };
+		}
+
+		void release( run& r )
+		{
+			for( const extent& e : r.extents )
+				deallocate( e.first, e.pages );
+			r = run{ std::vector<extent>(), 0 };
+		}
+
+		// Logarithmic method: buffer and levels [0,l) go to the first
+		// empty level l
+		void flush()
+		{
+			std::vector<Key> keys;
+			keys.swap( _buffer );
+
+			run input{ std::vector<extent>(), 0 };
+			std::size_t l = 0;
+			while( l < _levels.size() && _levels[l].size > 0 ) {
+				take( _levels[l], input );
+				l++;
+			}
+			write_level( l, input, keys, input.size + keys.size() );
+		}
+
+		void write_level( std::size_t l, run& input, std::vector<Key>& keys, std::size_t n )
+		{
+			if( _levels.size() <= l )
+				_levels.resize( l+1, level{ detail::no_page, 0, std::vector<extent>() } );
+
+			level built{ detail::no_page, 0, std::vector<extent>() };
+			built.root = build( input, keys, n, 0, built );
+			_levels[l] = std::move(built);
+		}
+
+		// Builds a tree with the keys of input and keys, n in total, and
+		// returns its root page. input pages are released.
+		detail::page_id build( run& input, std::vector<Key>& keys, std::size_t n,
+		                       std::size_t depth, level& out )
+		{
+			if( n <= _memory_keys ) {
+				for_each_key( input, [&keys]( const Key& k ) { keys.push_back( k ); } );
+				release( input );
+				std::sort( keys.begin(), keys.end() );
+				keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+				if( keys.empty() )
+					return detail::no_page;
+
+				const std::size_t pages = Layout::pages( keys.size() );
+				const detail::page_id first = allocate( pages );
+				append( out.extents, extent{ first, pages } );
+				out.size += keys.size();
+				const detail::page_id root = Layout::build( _file, first, keys.data(), keys.data() + keys.size(), depth );
+				std::vector<Key>().swap( keys );
+				return root;
+			}
+
+			// Splits are medians of a uniform sample of the keys
+			std::vector<Key> sample;
+			std::size_t seen = 0;
+			auto reservoir = [&]( const Key& k ) {
+				if( sample.size() < _memory_keys ) {
+					sample.push_back( k );
+				} else {
+					std::uniform_int_distribution<std::size_t> dis( 0, seen );
+					const std::size_t slot = dis( _gen );
+					if( slot < sample.size() )
+						sample[slot] = k;
+				}
+				seen++;
+			};
+			std::for_each( keys.begin(), keys.end(), reservoir );
+			for_each_key( input, reservoir );
+
+			internal_page page = internal_page();
+			Layout::choose_splits( page, sample.data(), sample.data() + sample.size(), depth );
+			std::vector<Key>().swap( sample );
+
+			std::array<Key,Layout::splits> split_keys;
+			for( std::size_t i = 0; i < Layout::splits; i++ )
+				split_keys[i] = page.nodes[i].key.load();
+
+			// Stream keys into one run per child. Copies of a split key
+			// are dropped, so that the children get fewer keys than n
+			// even if most keys are equal.
+			std::vector<run_writer> children( Layout::fanout, run_writer( *this ) );
+			std::array<bool,Layout::splits> split_seen;
+			split_seen.fill( false );
+			auto distribute = [&]( const Key& k ) {
+				std::size_t equal;
+				const std::size_t child = Layout::route( page, split_keys, k, equal );
+				if( equal < Layout::splits ) {
+					if( split_seen[equal] )
+						return;
+					split_seen[equal] = true;
+				}
+				children[child].push( k );
+			};
+			std::for_each( keys.begin(), keys.end(), distribute );
+			for_each_key( input, distribute );
+			std::vector<Key>().swap( keys );
+			release( input );
+
+			std::vector<run> runs;
+			for( run_writer& child : children )
+				runs.push_back( child.finish() );
+			children.clear();
+
+			for( std::size_t c = 0; c < Layout::fanout; c++ ) {
+				std::vector<Key> none;
+				page.children[c] = runs[c].size == 0? detail::no_page :
+					build( runs[c], none, runs[c].size, depth + Layout::height, out );
+			}
+
+			std::vector<char> buffer( PageSize, 0 );
+			std::memcpy( buffer.data(), &page, sizeof(page) );
+			const detail::page_id root = allocate( 1 );
+			_file.write( root, buffer.data() );
+			append( out.extents, extent{ root, 1 } );
+			return root;
+		}
+
+		// First fit allocation of consecutive pages. Cached copies of
+		// the pages are dropped since they are about to be rewritten.
+		detail::page_id allocate( std::size_t pages )
+		{
+			detail::page_id first = _end;
+			bool reused = false;
+			for( auto it = _free.begin(); it != _free.end() && !reused; ++it ) {
+				if( it->pages >= pages ) {
+					first = it->first;
+					it->first += pages;
+					it->pages -= pages;
+					if( it->pages == 0 )
+						_free.erase( it );
+					reused = true;
+				}
+			}
+			if( !reused )
+				_end += pages;
+			_pool.discard( first, pages );
+			return first;
+		}
+
+		void deallocate( detail::page_id first, std::size_t pages )
+		{
+			if( pages == 0 )
+				return;
+
+			auto it = std::lower_bound( _free.begin(), _free.end(), first,
+				[]( const extent& e, detail::page_id p ) { return e.first < p; } );
+			it = _free.insert( it, extent{ first, pages } );
+
+			// Coalesce with neighbours
+			auto next = it + 1;
+			if( next != _free.end() && it->first + it->pages == next->first ) {
+				it->pages += next->pages;
+				_free.erase( next );
+			}
+			if( it != _free.begin() ) {
+				auto prev = it - 1;
+				if( prev->first + prev->pages == it->first ) {
+					prev->pages += it->pages;
+					it = _free.erase( it ) - 1;
+				}
+			}
+			if( it->first + it->pages == _end ) {
+				_end = it->first;
+				_free.erase( it );
+			}
+		}
+
+		detail::page_file _file;
+		mutable detail::buffer_pool _pool;
+		std::size_t _buffer_capacity;
+		std::size_t _memory_keys;
+		std::vector<Key> _buffer;
+		std::vector<level> _levels;
+		std::vector<extent> _free;
+		detail::page_id _end;
+		std::default_random_engine _gen;
+};
+
+} // namespace ads
+
+#endif // PAGED_KDTREE
@@ -1,10 +1,246 @@
 
 #include "kdtree.hpp"
+#include "compressed_kdtree.hpp"
+#include "paged_kdtree.hpp"
+#include "windowed_kdtree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iterator>
+#include <random>
 
 #include <iostream>
 
 typedef std::tuple<int,char> Key;
 
+// Same keys stored as two columns
+struct Columns
+{
+	int operator()( std::uint32_t row, std::size_t d ) const
+	{
+		return d == 0? int(row) : 'a' + int(row);
+	}
+};
+
+// Allocations made through each allocator instance
+struct AllocationCounts
+{
+	std::size_t allocated;
+	std::size_t deallocated;
+};
+
+// Stateful allocator: copies compare equal only if they share counts
+template < typename T >
+struct CountingAllocator
+{
+	typedef T value_type;
+
+	explicit CountingAllocator( AllocationCounts* counts ) : counts(counts) {}
+
+	template < typename U >
+	CountingAllocator( const CountingAllocator<U>& other ) : counts(other.counts) {}
+
+	T* allocate( std::size_t n )
+	{
+		counts->allocated += n;
+		return static_cast<T*>( ::operator new( n * sizeof(T) ) );
+	}
+
+	void deallocate( T* p, std::size_t n )
+	{
+		counts->deallocated += n;
+		::operator delete( p );
+	}
+
+	AllocationCounts* counts;
+};
+
+template < typename T, typename U >
+bool operator==( const CountingAllocator<T>& lhs, const CountingAllocator<U>& rhs )
+{
+	return lhs.counts == rhs.counts;
+}
+
+template < typename T, typename U >
+bool operator!=( const CountingAllocator<T>& lhs, const CountingAllocator<U>& rhs )
+{
+	return !( lhs == rhs );
+}
+
+// Moves a tree of 10 keys onto a tree of 20 with a different allocator,
+// so keys are moved into new nodes. Prints the keys found, the nodes
+// each allocator allocated and released, and whether every node was
+// released once both trees are gone.
+template < typename Tree >
+void checkAllocator( const char* name )
+{
+	AllocationCounts first = { 0, 0 }, second = { 0, 0 };
+	std::size_t found = 0;
+	{
+		typedef CountingAllocator<Key> Allocator;
+		Tree target( { Key(0,'a') }, Allocator( &first ) );
+		Tree source( (Allocator( &second )) );
+		for( int i = 1; i < 20; i++ )
+			target.emplace( i, 'a' );
+		for( int i = 0; i < 10; i++ )
+			source.emplace( i, 'b'+i );
+		target = std::move( source );
+		for( int i = 0; i < 10; i++ )
+			found += target.find( Key(i,'b'+i) ) != nullptr;
+		std::cout << name << " allocator: " << found << " " << target.size() << " " << source.empty() << " "
+		          << first.allocated << "/" << first.deallocated << " "
+		          << second.allocated << "/" << second.deallocated;
+	}
+	std::cout << " " << (first.allocated == first.deallocated && second.allocated == second.deallocated)
+	          << std::endl;
+}
+
+// Sorted copies of the keys found by a query, so that results from
+// different trees can be compared
+template < typename T >
+std::vector<T> sortedKeys( const std::list<const T*>& found )
+{
+	std::vector<T> keys;
+	for( const T* k : found )
+		keys.push_back( *k );
+	std::sort( keys.begin(), keys.end() );
+	return keys;
+}
+
+// Two columns where rows repeat every 10 rows
+struct Table
+{
+	int operator()( std::uint32_t row, std::size_t d ) const
+	{
+		return d == 0? int(row % 10) : int(row * 7 % 5);
+	}
+};
+
+// Checks external_kdtree queries against a scan of the columns,
+// returns the number of queries that matched
+std::size_t checkRows()
+{
+	typedef ads::external_kdtree<2,Table> Rows;
+	const Table at;
+	Rows rows( at );
+	for( std::uint32_t r = 0; r < 200; r++ )
+		rows.insert( r );
+
+	std::size_t matching = 0;
+	for( int x = -1; x <= 10; x++ ) {
+		for( int y = -1; y <= 5; y++ ) {
+			const Rows::Point p = {{x,y}};
+			const Rows::Point upper = {{x+2,y+1}};
+			std::list<Rows::Row> exact, partial, range;
+			for( std::uint32_t r = 0; r < 200; r++ ) {
+				if( at(r,0) == x && at(r,1) == y )
+					exact.push_back( r );
+				if( at(r,1) == y )
+					partial.push_back( r );
+				if( x <= at(r,0) && at(r,0) <= x+2 && y <= at(r,1) && at(r,1) <= y+1 )
+					range.push_back( r );
+			}
+			std::list<Rows::Row> found_exact = rows.find( p );
+			std::list<Rows::Row> found_partial = rows.find( p, Rows::Mask(2) );
+			std::list<Rows::Row> found_range = rows.find( p, upper );
+			found_exact.sort();
+			found_partial.sort();
+			found_range.sort();
+			matching += found_exact == exact && found_partial == partial && found_range == range;
+		}
+	}
+	return matching;
+}
+
+// Coordinate that counts how many times it is compared
+struct Counted
+{
+	static std::size_t comparisons;
+	int value;
+
+	bool operator<( const Counted& other ) const { comparisons++; return value < other.value; }
+	bool operator==( const Counted& other ) const { comparisons++; return value == other.value; }
+	bool operator<=( const Counted& other ) const { comparisons++; return value <= other.value; }
+	explicit operator double() const { return value; }
+};
+std::size_t Counted::comparisons = 0;
+
+// Checks compressed queries on random 8-d double keys against a
+// linear scan, returns the number of queries that matched
+template < typename Code >
+std::size_t checkCompressed()
+{
+	typedef std::array<double,8> Point;
+	std::default_random_engine gen;
+	std::uniform_real_distribution<double> coordinate( -100.0, 100.0 );
+
+	std::vector<Point> points( 2000 );
+	for( Point& p : points )
+		for( double& x : p )
+			x = coordinate( gen );
+	ads::compressed_kdtree<Point,Code> compressed( points.begin(), points.end() );
+
+	std::size_t matching = 0;
+	for( std::size_t q = 0; q < 100; q++ ) {
+		const Point& key = points[q * 17];
+		Point lower, upper, missing = key;
+		for( std::size_t d = 0; d < 8; d++ ) {
+			lower[d] = key[d] - 60.0;
+			upper[d] = key[d] + 60.0;
+		}
+		missing[q % 8] += 1e-9;
+		ads::detail::mask_type<Point> mask( q % 256 );
+
+		std::size_t in_range = 0, partial = 0;
+		for( const Point& p : points ) {
+			in_range += ads::detail::in_range<Point>()( p, lower, upper );
+			partial += ads::detail::matches_partially<Point>()( p, key, mask );
+		}
+		matching += compressed.find( lower, upper ).size() == in_range
+		         && compressed.find( key, mask ).size() == partial
+		         && compressed.find( key ) && *compressed.find( key ) == key
+		         && !compressed.find( missing );
+	}
+	return matching;
+}
+
+// Checks approx_knearest on random points against a linear scan:
+// every returned key must be within (1+epsilon) of the true k-th
+// nearest distance. Returns the number of queries that passed.
+template < typename Tree >
+std::size_t checkNearest( std::size_t k, double epsilon )
+{
+	typedef typename Tree::Key Point;
+	std::default_random_engine gen;
+	std::uniform_int_distribution<int> coordinate( 0, 999 );
+
+	Tree tree;
+	std::vector<Point> points;
+	while( points.size() < 300 ) {
+		Point p( coordinate(gen), coordinate(gen) );
+		if( tree.insert( p ) )
+			points.push_back( p );
+	}
+
+	std::size_t passed = 0;
+	for( std::size_t q = 0; q < 50; q++ ) {
+		Point query( coordinate(gen), coordinate(gen) );
+		std::vector<double> distances;
+		for( const Point& p : points )
+			distances.push_back( ads::detail::squared_distance<Point>()( p, query ) );
+		std::nth_element( distances.begin(), distances.begin() + (k-1), distances.end() );
+		const double limit = (1.0+epsilon)*(1.0+epsilon)*distances[k-1];
+
+		auto nearest = tree.approx_knearest( query, k, epsilon );
+		bool within = nearest.keys.size() == k;
+		for( const Point* p : nearest.keys )
+			within = within && ads::detail::squared_distance<Point>()( *p, query ) <= limit;
+		passed += within;
+	}
+	return passed;
+}
+
 int main() {
 #ifdef USE_STANDARD
 	ads::standard_kdtree<Key> tree;
@@ -33,6 +269,284 @@ int main() {
 		std::cout << "Not found... ";
 	std::cout << "3,a" << std::endl;
 
+	// Partial match on the first dimension only
+	ads::detail::mask_type<Key> mask(1);
+	std::cout << "Partial match 3,*: "
+	          << tree.find( std::make_tuple(3,'a'), mask ).size() << " "
+	          << tree.find<1>( std::make_tuple(3,'a') ).size() << std::endl;
+
+#ifndef USE_QUADTREE
+	// Orthogonal range search, buffered and lazy
+	auto lower = std::make_tuple(2,'a');
+	auto upper = std::make_tuple(5,'e');
+	auto view = tree.range( lower, upper );
+	std::cout << "Range 2,a 5,e: "
+	          << tree.find( lower, upper ).size() << " "
+	          << std::distance( view.begin(), view.end() ) << " "
+	          << tree.range( lower, upper ).exists() << std::endl;
+
+	// Lazy partial match against the buffered one, and a missing key
+	auto partial_view = tree.partial( std::make_tuple(3,'a'), mask );
+	std::list<const Key*> lazy_partial( partial_view.begin(), partial_view.end() );
+	std::list<const Key*> buffered_partial = tree.find( std::make_tuple(3,'a'), mask );
+	lazy_partial.sort();
+	buffered_partial.sort();
+	std::cout << "Partial view 3,*: " << (lazy_partial == buffered_partial) << " "
+	          << partial_view.exists() << " "
+	          << tree.partial( std::make_tuple(42,'a'), mask ).exists() << std::endl;
+
+	// begin() stops at the first of the 20 matches of *,5 in a 20x20
+	// grid, so it compares fewer coordinates than the buffered find
+	typedef std::tuple<int,Counted> CountedKey;
+#ifdef USE_STANDARD
+	ads::standard_kdtree<CountedKey> counted;
+#else
+	ads::relaxed_kdtree<CountedKey> counted;
+#endif
+	for( int i = 0; i < 20; i++ )
+		for( int j = 0; j < 20; j++ )
+			counted.insert( CountedKey( i, Counted{j} ) );
+	const CountedKey column( 0, Counted{5} );
+	const ads::detail::mask_type<CountedKey> second(2);
+	Counted::comparisons = 0;
+	const std::size_t column_matches = counted.find( column, second ).size();
+	const std::size_t buffered_comparisons = Counted::comparisons;
+	Counted::comparisons = 0;
+	const CountedKey* first = *counted.partial( column, second ).begin();
+	std::cout << "Partial view *,5: " << column_matches << " "
+	          << (std::get<1>(*first).value == 5) << " "
+	          << (Counted::comparisons < buffered_comparisons) << std::endl;
+
+	// Batch exact search
+	std::vector<Key> batch;
+	for( int i = 9; i >= 0; i-- )
+		batch.push_back( std::make_tuple(i,'a'+i) );
+	batch.push_back( std::make_tuple(3,'a') );
+	std::size_t batch_found = 0;
+	for( const Key* k : tree.find( batch ) )
+		batch_found += k != nullptr;
+	std::cout << "Batch found: " << batch_found << "/" << batch.size() << std::endl;
+
+	// Batch range search, checked against one find per box
+	std::vector<std::pair<Key,Key> > boxes;
+	for( int i = 0; i < 10; i++ )
+		boxes.push_back( std::make_pair( std::make_tuple(i-2,'a'+i), std::make_tuple(i+1,'z') ) );
+	boxes.push_back( std::make_pair( std::make_tuple(5,'a'), std::make_tuple(4,'z') ) );
+	std::vector<std::list<const Key*> > box_found = tree.find( boxes );
+	std::size_t boxes_matching = 0;
+	for( std::size_t i = 0; i < boxes.size(); i++ ) {
+		std::list<const Key*> single = tree.find( boxes[i].first, boxes[i].second );
+		single.sort();
+		box_found[i].sort();
+		boxes_matching += single == box_found[i];
+	}
+	std::cout << "Batch ranges matching: " << boxes_matching << "/" << boxes.size() << std::endl;
+
+	// Pairs at distance <= 1.5 between the tree and itself
+	std::size_t pairs = 0;
+	ads::spatial_join( tree, tree, 1.5,
+		[&pairs]( const Key&, const Key& ) { pairs++; } );
+	std::cout << "Join within 1.5: " << pairs << std::endl;
+
+	// Same join on a 20x20 grid, deep enough to be split in tasks
+	// for 4 threads. Every point pairs with its 3x3 neighbourhood.
+	decltype(tree) grid;
+	for( int i = 0; i < 20; i++ )
+		for( int j = 0; j < 20; j++ )
+			grid.insert( std::make_tuple(i,'a'+j) );
+	std::size_t grid_pairs = 0;
+	ads::spatial_join( grid, grid, 1.5,
+		[&grid_pairs]( const Key&, const Key& ) { grid_pairs++; } );
+	std::atomic<std::size_t> threaded_pairs( 0 );
+	ads::spatial_join( grid, grid, 1.5,
+		[&threaded_pairs]( const Key&, const Key& ) { threaded_pairs++; }, 4 );
+	std::cout << "Grid join within 1.5: " << grid_pairs << " " << threaded_pairs
+	          << " (expected " << 58*58 << ")" << std::endl;
+
+	// Nearest neighbours of 3,a
+	auto nearest = tree.approx_knearest( std::make_tuple(3,'a'), 2 );
+	std::cout << "Nearest to 3,a:";
+	for( const Key* k : nearest.keys )
+		std::cout << " " << std::get<0>(*k) << "," << std::get<1>(*k);
+	std::cout << (nearest.exact? " (exact)" : " (approximate)") << std::endl;
+
+	// Same search on random points, within a factor 1.5 and with a
+	// budget too small to reach the 5 nearest
+#ifdef USE_STANDARD
+	typedef ads::standard_kdtree<std::tuple<int,int> > PointTree;
+#else
+	typedef ads::relaxed_kdtree<std::tuple<int,int> > PointTree;
+#endif
+	PointTree budget_tree;
+	for( int i = 0; i < 20; i++ )
+		for( int j = 0; j < 20; j++ )
+			budget_tree.insert( std::make_tuple(i,j) );
+	auto budget = budget_tree.approx_knearest( std::make_tuple(10,10), 5, 0.0, 3 );
+	std::cout << "Nearest within 1.5x: " << checkNearest<PointTree>( 5, 0.5 ) << "/50, budget of 3: "
+	          << (budget.visited_nodes <= 3) << " " << budget.exact << std::endl;
+#endif
+
+	// Move the tree away and merge other keys into it
+	decltype(tree) moved( std::move(tree) );
+	decltype(tree) other;
+	other.emplace( 3, 'a' );
+	other.emplace( 5, 'f' );
+	moved.merge( std::move(other) );
+	std::cout << "Merged: " << tree.empty() << " " << other.empty() << " "
+	          << (moved.find( std::make_tuple(3,'a') ) != nullptr) << " "
+	          << (moved.find( std::make_tuple(9,'j') ) != nullptr) << " "
+	          << moved.size();
+
+	// Trees of comparable size are rebuilt together
+	decltype(tree) shifted;
+	for( int i = 0; i < 10; i++ )
+		shifted.insert( std::make_tuple(i,'b'+i) );
+	moved.merge( std::move(shifted) );
+	std::size_t merged_found = 0;
+	for( int i = 0; i < 10; i++ )
+		merged_found += (moved.find( std::make_tuple(i,'a'+i) ) != nullptr)
+		              + (moved.find( std::make_tuple(i,'b'+i) ) != nullptr);
+	std::cout << " " << moved.size() << " " << merged_found << std::endl;
+
+	// Move assignment between trees with unequal stateful allocators
+	checkAllocator<ads::standard_kdtree<Key,CountingAllocator<Key> > >( "Standard" );
+	checkAllocator<ads::relaxed_kdtree<Key,CountingAllocator<Key> > >( "Relaxed" );
+
+	// Same keys, letting the planner choose how to run queries
+	ads::planned_kdtree<Key> planned;
+	for( int i = 0; i < 10; i++ )
+		planned.insert( std::make_tuple(i,'a'+i) );
+	ads::detail::query_plan plan;
+	std::cout << "Planned range: "
+	          << planned.find( std::make_tuple(2,'a'), std::make_tuple(5,'e'), &plan ).size()
+	          << (plan.strategy == ads::detail::query_strategy::scan? " (scan)" : " (tree)")
+	          << std::endl;
+
+	// 1000 keys, 9 in 10 with 'a' as second coordinate. Selective
+	// queries are run on the tree, the others as a scan, and both give
+	// the same keys as a plain kd-tree
+	ads::planned_kdtree<Key> skewed;
+	ads::standard_kdtree<Key> plain;
+	for( int i = 0; i < 1000; i++ ) {
+		const Key k( i, i%10? 'a' : 'b' + i%20/10 );
+		skewed.insert( k );
+		plain.insert( k );
+	}
+	const Key narrow_lower( 100, 'a' ), narrow_upper( 110, 'c' );
+	const Key wide_lower( 0, 'a' ), wide_upper( 999, 'z' );
+	const ads::detail::mask_type<Key> second_only(2);
+	ads::detail::query_plan narrow_plan, wide_plan, rare_plan, common_plan;
+	const bool narrow_same = sortedKeys( skewed.find( narrow_lower, narrow_upper, &narrow_plan ) )
+	                      == sortedKeys( plain.find( narrow_lower, narrow_upper ) );
+	const bool wide_same = sortedKeys( skewed.find( wide_lower, wide_upper, &wide_plan ) )
+	                    == sortedKeys( plain.find( wide_lower, wide_upper ) );
+	const bool rare_same = sortedKeys( skewed.find( Key(0,'b'), second_only, &rare_plan ) )
+	                    == sortedKeys( plain.find( Key(0,'b'), second_only ) );
+	const bool common_same = sortedKeys( skewed.find( Key(0,'a'), second_only, &common_plan ) )
+	                      == sortedKeys( plain.find( Key(0,'a'), second_only ) );
+	const ads::detail::query_strategy tree_strategy = ads::detail::query_strategy::tree;
+	std::cout << "Planned 1000 keys: "
+	          << (narrow_plan.strategy == tree_strategy) << narrow_same << " "
+	          << (wide_plan.strategy != tree_strategy) << wide_same << " "
+	          << (rare_plan.strategy == tree_strategy) << rare_same << " "
+	          << (common_plan.strategy != tree_strategy) << common_same << std::endl;
+
+	// Same keys indexed by row
+	ads::external_kdtree<2,Columns> rows;
+	for( std::uint32_t i = 0; i < 10; i++ )
+		rows.insert( i );
+	std::cout << "Rows at 3,d: " << rows.find( {{3,'d'}} ).size() << std::endl;
+
+	// 200 rows on 10 distinct points, 20 rows per point; the same row
+	// can not be inserted twice
+	ads::external_kdtree<2,Table> table_rows;
+	for( std::uint32_t i = 0; i < 200; i++ )
+		table_rows.insert( i );
+	std::cout << "Table rows: " << checkRows() << "/84 "
+	          << table_rows.find( {{3,1}} ).size() << " "
+	          << table_rows.insert( 13 ) << std::endl;
+
+	// One key per second, keeping the last 5 seconds
+	typedef std::chrono::steady_clock Clock;
+	ads::windowed_kdtree<Key> window( std::chrono::seconds(5), std::chrono::seconds(1) );
+	for( int i = 0; i < 10; i++ )
+		window.insert( std::make_tuple(i,'a'+i), Clock::time_point( std::chrono::seconds(i) ) );
+	std::cout << "Window: " << window.buckets() << " "
+	          << (window.find( std::make_tuple(2,'c'), Clock::time_point(), Clock::time_point::max() ) != nullptr) << " "
+	          << (window.find( std::make_tuple(7,'h'), Clock::time_point(), Clock::time_point::max() ) != nullptr)
+	          << std::endl;
+
+	// Queries from 5 to 6 seconds only visit those two live buckets,
+	// and keys older than the window are rejected
+	auto at = []( int seconds ) { return Clock::time_point( std::chrono::seconds(seconds) ); };
+	std::cout << "Window from 5 to 6: "
+	          << window.find( std::make_tuple(0,'a'), std::make_tuple(9,'z'), at(5), at(6) ).size() << " "
+	          << window.find( std::make_tuple(0,'f'), ads::detail::mask_type<Key>(2), at(5), at(6) ).size() << " "
+	          << (window.find( std::make_tuple(7,'h'), at(5), at(6) ) != nullptr) << " "
+	          << (window.find( std::make_tuple(7,'h'), at(7), at(7) ) != nullptr) << " "
+	          << window.insert( std::make_tuple(2,'z'), at(2) ) << std::endl;
+
+	// Expiring with no new keys also moves the window forward: keys
+	// inserted at 100 to 119 seconds in a 10 second window are dropped
+	// at 200 seconds, and a key at 112 seconds is then too old
+	ads::windowed_kdtree<Key> idle( std::chrono::seconds(10), std::chrono::seconds(1) );
+	for( int i = 100; i < 120; i++ )
+		idle.insert( std::make_tuple(i,'a'), at(i) );
+	const std::size_t idle_buckets = idle.buckets();
+	idle.expire( at(200) );
+	std::cout << "Window expired at 200: " << idle_buckets << " " << idle.buckets() << " "
+	          << idle.insert( std::make_tuple(112,'a'), at(112) ) << " " << idle.buckets() << " "
+	          << idle.insert( std::make_tuple(195,'a'), at(195) ) << " " << idle.buckets() << std::endl;
+
+	// Same keys stored quantized, 8 bits per coordinate
+	{
+		std::vector<Key> keys;
+		for( int i = 0; i < 10; i++ )
+			keys.push_back( std::make_tuple(i,'a'+i) );
+		ads::compressed_kdtree<Key,std::uint8_t> compressed( keys.begin(), keys.end() );
+		std::cout << "Compressed: " << compressed.size() << " "
+		          << (compressed.find( std::make_tuple(3,'d') ) != nullptr) << " "
+		          << (compressed.find( std::make_tuple(3,'a') ) != nullptr) << " "
+		          << compressed.find( std::make_tuple(2,'a'), std::make_tuple(5,'e') ).size() << " "
+		          << compressed.find( std::make_tuple(3,'a'), ads::detail::mask_type<Key>(1) ).size() << std::endl;
+	}
+	std::cout << "Compressed 8-d queries matching: "
+	          << checkCompressed<std::uint8_t>() << "/100 (8 bit) "
+	          << checkCompressed<std::uint16_t>() << "/100 (16 bit)" << std::endl;
+
+	// Same keys in a disk resident tree
+	{
+		std::vector<Key> keys;
+		for( int i = 0; i < 10; i++ )
+			keys.push_back( std::make_tuple(i,'a'+i) );
+		ads::paged_kdtree<Key> paged( "test.pages" );
+		paged.bulk_load( keys.begin(), keys.end() );
+		paged.insert( std::make_tuple(3,'a') );
+		std::cout << "Paged: " << paged.size() << " "
+		          << paged.find( std::make_tuple(3,'a') ) << " "
+		          << paged.find( std::make_tuple(2,'a'), std::make_tuple(5,'e') ).size() << std::endl;
+	}
+	std::remove( "test.pages" );
+
+	// 1040 keys in 256 byte pages, a 4 page pool, a 16 key buffer and
+	// at most 64 keys in memory while building: exercises internal
+	// pages, eviction, the logarithmic flushes and out of core builds
+	{
+		ads::paged_kdtree<Key,256> paged( "test_small.pages", 4, 16, 64 );
+		for( int i = 0; i < 40; i++ )
+			for( int j = 0; j < 26; j++ )
+				paged.insert( std::make_tuple(i,'a'+j) );
+		std::size_t found = 0;
+		for( int i = 0; i < 40; i++ )
+			for( int j = 0; j < 26; j++ )
+				found += paged.find( std::make_tuple(i,'a'+j) );
+		std::cout << "Paged small pages: " << paged.size() << " " << found << " "
+		          << paged.find( std::make_tuple(2,'a'), std::make_tuple(5,'e') ).size() << " "
+		          << paged.find( std::make_tuple(7,'a'), ads::detail::mask_type<Key>(1) ).size() << " "
+		          << (paged.pool().misses() > paged.pages()) << std::endl;
+	}
+	std::remove( "test_small.pages" );
+
 	return 0;
 }
 
@@ -0,0 +1,189 @@
+//
+// KD-tree is a C++ header-only library with includes some
+// implementations for multi-dimensional tree searches.
+//
+// Copyright (C) 2016 Jorge Bellon Castro
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef WINDOWED_KDTREE
+#define WINDOWED_KDTREE
+
+#include "kdtree.hpp"
+
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
+#include <stdexcept>
+
+namespace ads {
+
+// Index over the keys inserted during the last window of time.
+//
+// Time is split in buckets of a fixed width, each one with its own tree.
+// Once the newest insertion time moves a whole window past the end of
+// the oldest bucket, that bucket is dropped as a whole: there are no
+// per-key deletions and memory stays bounded under continuous ingest.
+// Queries only visit the buckets that overlap the requested interval,
+// so keys are filtered by time with bucket granularity.
+template < typename T,
+	typename Node = detail::kdtree_node<T>,
+	typename Clock = std::chrono::steady_clock
+	>
+class windowed_kdtree
+{
+	public:
+		typedef T                          Key;
+		typedef detail::mask_type<T>       Mask;
+		typedef typename Clock::time_point Time;
+		typedef typename Clock::duration   Duration;
+		typedef generic_kdtree<T,Node>     Tree;
+
+		windowed_kdtree( Duration window, Duration bucket_width ) :
+			_window(window),
+			_width(bucket_width),
+			_first(),
+			_latest(),
+			_started(false),
+			_buckets()
+		{
+			if( bucket_width <= Duration::zero() )
+				throw std::invalid_argument( "Bucket width must be positive" );
+		}
+
+		bool empty() const
+		{
+			for( const std::unique_ptr<Tree>& tree : _buckets )
+				if( tree && !tree->empty() )
+					return false;
+			return true;
+		}
+
+		//! Number of live buckets, including empty ones in between
+		std::size_t buckets() const { return _buckets.size(); }
+
+		// Inserts k with timestamp t. Keys older than the window are
+		// rejected; newer ones move the window forward.
+		bool insert( const Key& k, Time t )
+		{
+			if( _started && t < horizon() )
+				return false;
+
+			if( !_started || _latest < t )
+				expire( t );
+
+			std::unique_ptr<Tree>& tree = bucket( t );
+			if( !tree )
+				tree.reset( new Tree() );
+			return tree->insert( k );
+		}
+
+		// Drops every bucket that ended more than a window before now.
+		// The window moves forward to now, so keys older than it are
+		// rejected afterwards even if no key was inserted since.
+		void expire( Time now )
+		{
+			if( !_started || _latest < now ) {
+				_latest = now;
+				_started = true;
+			}
+			while( !_buckets.empty() && _first + _width <= now - _window ) {
+				_buckets.pop_front();
+				_first += _width;
+			}
+		}
+
+		void expire()
+		{
+			expire( _latest );
+		}
+
+		// Exact search
+		const Key* find( const Key& k, Time from, Time to ) const
+		{
+			const Key* found = nullptr;
+			for( std::size_t i = 0; i < _buckets.size() && !found; i++ )
+				if( overlaps( i, from, to ) )
+					found = _buckets[i]->find( k );
+			return found;
+		}
+
+		// Partial match
+		std::list<const Key*> find( const Key& k, const Mask& mask, Time from, Time to ) const
+		{
+			std::list<const Key*> list;
+			for( std::size_t i = 0; i < _buckets.size(); i++ )
+				if( overlaps( i, from, to ) )
+					list.splice( list.end(), _buckets[i]->find( k, mask ) );
+			return list;
+		}
+
+		// Orthogonal range search
+		std::list<const Key*> find( const Key& lower, const Key& upper, Time from, Time to ) const
+		{
+			std::list<const Key*> list;
+			for( std::size_t i = 0; i < _buckets.size(); i++ )
+				if( overlaps( i, from, to ) )
+					list.splice( list.end(), _buckets[i]->find( lower, upper ) );
+			return list;
+		}
+
+	private:
+		// Oldest time still inside the window
+		Time horizon() const
+		{
+			return start_of( _latest - _window );
+		}
+
+		Time start_of( Time t ) const
+		{
+			return Time( (t.time_since_epoch() / _width) * _width );
+		}
+
+		// Bucket slot for time t, adding empty slots as needed
+		std::unique_ptr<Tree>& bucket( Time t )
+		{
+			const Time start = start_of( t );
+			if( _buckets.empty() ) {
+				_first = start;
+				_buckets.emplace_back();
+			}
+			while( start < _first ) {
+				_buckets.emplace_front();
+				_first -= _width;
+			}
+			const std::size_t index = (start - _first) / _width;
+			while( _buckets.size() <= index )
+				_buckets.emplace_back();
+			return _buckets[index];
+		}
+
+		bool overlaps( std::size_t i, Time from, Time to ) const
+		{
+			const Time start = _first + static_cast<typename Duration::rep>(i) * _width;
+			return _buckets[i] && start <= to && from < start + _width;
+		}
+
+		Duration _window;
+		Duration _width;
+		Time _first;  //!< Start of the oldest bucket
+		Time _latest; //!< Newest insertion or expiry time
+		bool _started; //!< Whether _latest was set
+		std::deque<std::unique_ptr<Tree> > _buckets;
+};
+
+} // namespace ads
+
+#endif // WINDOWED_KDTREE